@@ -0,0 +1,1120 @@
+#include "FramePipeline.h"
+#include "RecorderPipeline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Drives the real sample paths with synthetic depth, visible, infrared and
+// IMU samples so they can be measured without a sensor attached:
+//   streamer: SimpleStreamer's SDK callback (StreamerOutput) and FramePipeline
+//   recorder: Recorder's RecorderPipeline (correct and record stages) into a
+//             stand-in OCC writer
+// Synthetic frames have the shape of the SDK's (Synthetic::CaptureSessionSample
+// below), including a lens model for undistortion and a stand-in depth
+// correction of comparable per-pixel work.
+
+static const char usageMsg[] =
+    "usage: Benchmark [-h] [options...]\n"
+    "-h/--help: Show this message\n"
+    "-t/--target <streamer|recorder>: Sample path to drive (default streamer)\n"
+    "-D/--depth <WxH>: Synthetic depth resolution (default 640x480)\n"
+    "-V/--visible <WxH>: Synthetic visible resolution (default 640x480)\n"
+    "-I/--infrared <WxH>: Synthetic infrared resolution, 0x0 to disable (default 0x0); the\n"
+    "    streamer logs infrared as SimpleStreamer does but writes none, the recorder records it\n"
+    "-r/--frame-rate <Hz>: Frame rate of each stream (default 30)\n"
+    "-m/--imu-rate <Hz>: Accelerometer and gyroscope rate, 0 to disable (default 100)\n"
+    "-n/--frames <count>: Number of capture instants to generate (default 300)\n"
+    "-o/--output <dir>: Directory for written samples (default /tmp/structurecore-bench)\n"
+    "-p/--paced: Deliver samples at the configured rates instead of as fast as possible\n"
+    "-s/--static: Keep the synthetic scene and rig still\n"
+    "-k/--keyframes: Enable the keyframe gate\n"
+    "-Q/--queue-depth <n>: Capacity of each pipeline queue (default 16 streamer, 8 recorder)\n"
+    "--write-policy <block|drop-oldest|degrade>: streamer: when writing falls behind (default block)\n"
+    "--display: streamer: show frames as SimpleStreamer does (needs a display); without it\n"
+    "    non-keyframes are not queued, so drop-oldest has nothing droppable and blocks\n"
+    "--no-frame-sync: recorder: deliver depth, visible and infrared as separate samples\n"
+    "-d/--depth-correction: recorder: run depth correction in the correct stage\n"
+    "--correct-policy <block|drop-oldest|degrade>: recorder: when correction falls behind (default block)\n"
+    "--record-policy <block|drop-oldest>: recorder: when writing falls behind (default block)\n"
+    "-j/--json: Print results as JSON\n"
+    "\n"
+    "Capture latency is the time spent in the callback on the capture thread (what\n"
+    "the SDK would see). End-to-end latency runs from handing a sample to the\n"
+    "pipeline until it is written; the streamer writes IMU inline, so it has none.\n"
+    "The streamer target's per-sample log lines go to <dir>/streamer.log. The\n"
+    "recorder target starts at RecorderPipeline::submit(); Recorder's rate\n"
+    "monitors and GUI are not part of it. Throughput is frames written per\n"
+    "wall-clock second, including draining the pipeline. Allocations are counted\n"
+    "at the malloc level (all threads, OpenCV included) on glibc, and only via\n"
+    "operator new elsewhere; the JSON field allocation_counter says which.\n"
+    "";
+
+static std::atomic<unsigned long long> allocationCount(0);
+
+#ifdef __GLIBC__
+// Interpose the C allocator so OpenCV's buffers (PNG encode, convertTo) count too
+static const char allocationCounter[] = "malloc";
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *p);
+
+void *malloc(size_t size) noexcept {
+    ++allocationCount;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) noexcept {
+    ++allocationCount;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) noexcept {
+    ++allocationCount;
+    return __libc_realloc(p, size);
+}
+
+void *memalign(size_t alignment, size_t size) noexcept {
+    ++allocationCount;
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+    ++allocationCount;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) noexcept {
+    ++allocationCount;
+    void *p = __libc_memalign(alignment, size);
+    if (!p) {
+        return ENOMEM;
+    }
+    *out = p;
+    return 0;
+}
+
+void free(void *p) noexcept {
+    __libc_free(p);
+}
+}
+#else
+// Without glibc only C++ allocations are visible; OpenCV buffers are not counted
+static const char allocationCounter[] = "operator_new";
+
+void *operator new(size_t size) {
+    ++allocationCount;
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+#endif
+
+// Just enough of the Structure SDK's sample types for the real pipelines to
+// compile against. Frames share their pixels on copy, as the SDK's do.
+namespace Synthetic {
+    struct Vector3 {
+        float x = 0.0f, y = 0.0f, z = 0.0f;
+    };
+
+    struct Intrinsics {
+        float cx = 0.0f, cy = 0.0f, fx = 0.0f, fy = 0.0f;
+    };
+
+    struct Matrix4 {
+        float m[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    };
+
+    static std::ostream& operator<<(std::ostream& os, const Matrix4& p) {
+        for (int r = 0; r < 4; ++r) {
+            os << (r ? "\n" : "") << p.m[4 * r] << " " << p.m[4 * r + 1] << " " << p.m[4 * r + 2] << " " << p.m[4 * r + 3];
+        }
+        return os;
+    }
+
+    template <typename T>
+    using Pixels = std::shared_ptr<std::vector<T>>;
+
+    // Radial lens model. The bilinear remap table is built once per camera,
+    // so undistorting a frame is one table-driven pass like the SDK's.
+    class Lens {
+    public:
+        Lens(int width, int height) : _width(width), _height(height) {
+            _intrinsics.fx = _intrinsics.fy = 0.9f * width;
+            _intrinsics.cx = 0.5f * width;
+            _intrinsics.cy = 0.5f * height;
+            const float k1 = -0.28f, k2 = 0.07f;
+            _map.resize((size_t)width * height);
+            for (int v = 0; v < height; ++v) {
+                for (int u = 0; u < width; ++u) {
+                    float x = (u - _intrinsics.cx) / _intrinsics.fx;
+                    float y = (v - _intrinsics.cy) / _intrinsics.fy;
+                    float r2 = x * x + y * y;
+                    float f = 1.0f + k1 * r2 + k2 * r2 * r2;
+                    float xs = x * f * _intrinsics.fx + _intrinsics.cx;
+                    float ys = y * f * _intrinsics.fy + _intrinsics.cy;
+                    int x0 = (int)floorf(xs), y0 = (int)floorf(ys);
+                    Tap& t = _map[(size_t)v * width + u];
+                    if (x0 < 0 || y0 < 0 || x0 + 1 >= width || y0 + 1 >= height) {
+                        t.offset = -1;
+                        continue;
+                    }
+                    t.offset = y0 * width + x0;
+                    t.wx = (uint8_t)((xs - x0) * 255.0f + 0.5f);
+                    t.wy = (uint8_t)((ys - y0) * 255.0f + 0.5f);
+                }
+            }
+        }
+
+        const Intrinsics& intrinsics() const { return _intrinsics; }
+
+        void undistort(const uint8_t *src, uint8_t *dst) const {
+            for (size_t i = 0; i < _map.size(); ++i) {
+                const Tap& t = _map[i];
+                if (t.offset < 0) {
+                    dst[i] = 0;
+                    continue;
+                }
+                const uint8_t *p = src + t.offset;
+                int top = p[0] * (255 - t.wx) + p[1] * t.wx;
+                int bottom = p[_width] * (255 - t.wx) + p[_width + 1] * t.wx;
+                dst[i] = (uint8_t)((top * (255 - t.wy) + bottom * t.wy + 32512) / 65025);
+            }
+        }
+
+    private:
+        struct Tap {
+            int32_t offset = -1;
+            uint8_t wx = 0;
+            uint8_t wy = 0;
+        };
+
+        int _width;
+        int _height;
+        Intrinsics _intrinsics;
+        std::vector<Tap> _map;
+    };
+
+    class DepthFrame {
+    public:
+        DepthFrame() {}
+        DepthFrame(double t, int width, int height, Pixels<float> pixels)
+            : _t(t), _width(width), _height(height), _pixels(pixels) {}
+
+        bool isValid() const { return (bool)_pixels; }
+        double timestamp() const { return _t; }
+        int width() const { return _width; }
+        int height() const { return _height; }
+        const float *depthInMillimeters() const { return _pixels->data(); }
+
+        Matrix4 colorCameraPoseInDepthCoordinateFrame() const {
+            Matrix4 pose;
+            pose.m[3] = -0.03f; // Visible camera sits 3 cm from the depth camera
+            return pose;
+        }
+
+        // Stand-in for temperature compensation and the speckle filter: scales
+        // every pixel and invalidates pixels with fewer than two similar
+        // neighbours. Works in place on the shared pixels, as the SDK does.
+        void applyExpensiveCorrection() {
+            static thread_local std::vector<float> src;
+            std::vector<float>& d = *_pixels;
+            src.assign(d.begin(), d.end());
+            for (int y = 1; y + 1 < _height; ++y) {
+                for (int x = 1; x + 1 < _width; ++x) {
+                    size_t i = (size_t)y * _width + x;
+                    float c = src[i];
+                    if (c <= 0.0f) {
+                        continue;
+                    }
+                    int similar = 0;
+                    for (int dy = -1; dy <= 1; ++dy) {
+                        for (int dx = -1; dx <= 1; ++dx) {
+                            float n = src[i + (ptrdiff_t)dy * _width + dx];
+                            similar += (dx || dy) && fabsf(n - c) < 0.02f * c;
+                        }
+                    }
+                    d[i] = similar < 2 ? 0.0f : c * 1.0005f;
+                }
+            }
+        }
+
+    private:
+        double _t = 0.0;
+        int _width = 0;
+        int _height = 0;
+        Pixels<float> _pixels;
+    };
+
+    class VisibleFrame {
+    public:
+        VisibleFrame() {}
+        VisibleFrame(double t, int width, int height, Pixels<uint8_t> pixels, std::shared_ptr<const Lens> lens)
+            : _t(t), _width(width), _height(height), _pixels(pixels), _lens(lens) {}
+
+        bool isValid() const { return (bool)_pixels; }
+        double timestamp() const { return _t; }
+        int width() const { return _width; }
+        int height() const { return _height; }
+        const uint8_t *yData() const { return _pixels->data(); }
+        Intrinsics intrinsics() const { return _lens->intrinsics(); }
+
+        // Like the SDK, returns a new frame with its own pixels
+        VisibleFrame undistorted() const {
+            Pixels<uint8_t> out = std::make_shared<std::vector<uint8_t>>(_pixels->size());
+            _lens->undistort(_pixels->data(), out->data());
+            return VisibleFrame(_t, _width, _height, out, _lens);
+        }
+
+    private:
+        double _t = 0.0;
+        int _width = 0;
+        int _height = 0;
+        Pixels<uint8_t> _pixels;
+        std::shared_ptr<const Lens> _lens;
+    };
+
+    class InfraredFrame {
+    public:
+        InfraredFrame() {}
+        InfraredFrame(double t, int width, int height, Pixels<uint16_t> pixels)
+            : _t(t), _width(width), _height(height), _pixels(pixels) {}
+
+        bool isValid() const { return (bool)_pixels; }
+        double timestamp() const { return _t; }
+        int width() const { return _width; }
+        int height() const { return _height; }
+        const uint16_t *data() const { return _pixels->data(); }
+
+    private:
+        double _t = 0.0;
+        int _width = 0;
+        int _height = 0;
+        Pixels<uint16_t> _pixels;
+    };
+
+    class AccelerometerEvent {
+    public:
+        AccelerometerEvent() {}
+        AccelerometerEvent(double t, Vector3 a) : _t(t), _a(a) {}
+        double timestamp() const { return _t; }
+        const Vector3& acceleration() const { return _a; }
+
+    private:
+        double _t = 0.0;
+        Vector3 _a;
+    };
+
+    class GyroscopeEvent {
+    public:
+        GyroscopeEvent() {}
+        GyroscopeEvent(double t, Vector3 r) : _t(t), _r(r) {}
+        double timestamp() const { return _t; }
+        const Vector3& rotationRate() const { return _r; }
+
+    private:
+        double _t = 0.0;
+        Vector3 _r;
+    };
+
+    struct CaptureSessionSample {
+        enum class Type {
+            Invalid,
+            DepthFrame,
+            VisibleFrame,
+            InfraredFrame,
+            SynchronizedFrames,
+            AccelerometerEvent,
+            GyroscopeEvent,
+        };
+
+        Type type = Type::Invalid;
+        DepthFrame depthFrame;
+        VisibleFrame visibleFrame;
+        InfraredFrame infraredFrame;
+        AccelerometerEvent accelerometerEvent;
+        GyroscopeEvent gyroscopeEvent;
+    };
+
+    // Stand-in for ST::OCCFileWriter: appends a small header and the raw
+    // payload of each stream in the sample
+    class OCCFileWriter {
+    public:
+        ~OCCFileWriter() {
+            if (_file) {
+                fclose(_file);
+            }
+        }
+
+        bool startWritingToFile(const char *path) {
+            _file = fopen(path, "wb");
+            return _file != nullptr;
+        }
+
+        void writeCaptureSample(const CaptureSessionSample& sample) {
+            int32_t type = (int32_t)sample.type;
+            fwrite(&type, sizeof(type), 1, _file);
+            switch (sample.type) {
+                case CaptureSessionSample::Type::AccelerometerEvent:
+                    writeImu(StreamBit::Accel, sample.accelerometerEvent.timestamp(), sample.accelerometerEvent.acceleration());
+                    return;
+                case CaptureSessionSample::Type::GyroscopeEvent:
+                    writeImu(StreamBit::Gyro, sample.gyroscopeEvent.timestamp(), sample.gyroscopeEvent.rotationRate());
+                    return;
+                default:;
+            }
+            const DepthFrame& d = sample.depthFrame;
+            if (d.isValid()) {
+                writeFrame(StreamBit::Depth, d.timestamp(), d.depthInMillimeters(), (size_t)d.width() * d.height());
+            }
+            const VisibleFrame& v = sample.visibleFrame;
+            if (v.isValid()) {
+                writeFrame(StreamBit::Visible, v.timestamp(), v.yData(), (size_t)v.width() * v.height());
+            }
+            const InfraredFrame& ir = sample.infraredFrame;
+            if (ir.isValid()) {
+                writeFrame(StreamBit::Infrared, ir.timestamp(), ir.data(), (size_t)ir.width() * ir.height());
+            }
+        }
+
+        unsigned long long written(unsigned streamBit) const {
+            return _written[StreamBit::index(streamBit)];
+        }
+
+    private:
+        template <typename T>
+        void writeFrame(unsigned streamBit, double t, const T *data, size_t n) {
+            fwrite(&t, sizeof(t), 1, _file);
+            fwrite(data, sizeof(T), n, _file);
+            ++_written[StreamBit::index(streamBit)];
+        }
+
+        void writeImu(unsigned streamBit, double t, const Vector3& v) {
+            fwrite(&t, sizeof(t), 1, _file);
+            fwrite(&v, sizeof(v), 1, _file);
+            ++_written[StreamBit::index(streamBit)];
+        }
+
+        FILE *_file = nullptr;
+        unsigned long long _written[StreamBit::count] = {};
+    };
+}
+
+using Sample = Synthetic::CaptureSessionSample;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+    enum class Target {
+        Streamer,
+        Recorder,
+    };
+
+    struct Resolution {
+        int width = 0;
+        int height = 0;
+        bool enabled() const { return width > 0 && height > 0; }
+        size_t pixels() const { return (size_t)width * height; }
+    };
+
+    struct BenchConfig {
+        Target target = Target::Streamer;
+        Resolution depth{640, 480};
+        Resolution visible{640, 480};
+        Resolution infrared{0, 0};
+        double frameRate = 30.0;
+        double imuRate = 100.0;
+        int frames = 300;
+        std::string outputDir = "/tmp/structurecore-bench";
+        bool paced = false;
+        bool staticScene = false;
+        bool json = false;
+        KeyframeGateConfig keyframes;
+        size_t queueDepth = 0; // 0 until resolved for the target
+        // streamer
+        QueuePolicy writePolicy = QueuePolicy::Block;
+        bool display = false;
+        // recorder
+        bool frameSync = true;
+        bool depthCorrection = false;
+        PipelineConfig recorder;
+    };
+
+    // Capture-side latency per sample type. In paced mode, `late` counts
+    // deliveries that started more than half a period behind schedule and
+    // `overrun` counts deliveries that took longer than one period.
+    struct LatencyStats {
+        std::vector<double> usec;
+        unsigned long long late = 0;
+        unsigned long long overrun = 0;
+
+        void add(double us) {
+            usec.push_back(us);
+        }
+        double percentile(double p) {
+            if (usec.empty()) {
+                return 0.0;
+            }
+            std::sort(usec.begin(), usec.end());
+            size_t i = (size_t)(p * (usec.size() - 1) + 0.5);
+            return usec[i];
+        }
+        double mean() const {
+            double sum = 0.0;
+            for (double u : usec) {
+                sum += u;
+            }
+            return usec.empty() ? 0.0 : sum / usec.size();
+        }
+    };
+
+    struct RunResult {
+        LatencyStats frames;
+        LatencyStats imu;
+        // Submit to written, filled on the writer thread
+        LatencyStats framesEndToEnd;
+        LatencyStats imuEndToEnd;
+        double deliverSec = 0.0;
+        double wallSec = 0.0;
+        unsigned long long allocations = 0;
+        unsigned long long framesWritten = 0;
+        // Per stream, indexed by StreamBit::index()
+        unsigned long long delivered[StreamBit::count] = {};
+        unsigned long long written[StreamBit::count] = {};
+        std::vector<StageStats> stages;
+        KeyframeGateStats keyframes;
+        // streamer only
+        unsigned long long keyframesDropped = 0;
+        unsigned long long displayFramesDropped = 0;
+    };
+
+    // Sorts end-to-end latencies by sample type. Reserves up front so the
+    // writer thread does not allocate while it is measured.
+    static std::function<void(unsigned, double)> endToEndRecorder(const BenchConfig& config, RunResult& r) {
+        r.framesEndToEnd.usec.reserve((size_t)config.frames * 3);
+        r.imuEndToEnd.usec.reserve((size_t)(2 * config.frames * config.imuRate / config.frameRate) + 2);
+        return [&r](unsigned streams, double usec) {
+            bool imu = streams & (StreamBit::Accel | StreamBit::Gyro);
+            (imu ? r.imuEndToEnd : r.framesEndToEnd).add(usec);
+        };
+    }
+
+    // Hands out pixel buffers, reusing one once no frame refers to it
+    template <typename T>
+    class BufferPool {
+    public:
+        Synthetic::Pixels<T> get(size_t n) {
+            for (auto& b : _buffers) {
+                if (b.use_count() == 1) {
+                    // Pairs with the release in the last other owner's reference drop
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    b->resize(n);
+                    return b;
+                }
+            }
+            _buffers.push_back(std::make_shared<std::vector<T>>(n));
+            return _buffers.back();
+        }
+
+    private:
+        std::vector<Synthetic::Pixels<T>> _buffers;
+    };
+
+    class SampleGenerator {
+    public:
+        explicit SampleGenerator(const BenchConfig& config) : _config(config) {
+            if (config.visible.enabled()) {
+                _lens = std::make_shared<Synthetic::Lens>(config.visible.width, config.visible.height);
+            }
+        }
+
+        // A bar pattern that scrolls one step per frame over a tilted depth plane
+        Sample frames(int index, double t) {
+            Sample s;
+            s.type = Sample::Type::SynchronizedFrames;
+            int shift = _config.staticScene ? 0 : index * 4;
+            const Resolution& vr = _config.visible;
+            if (vr.enabled()) {
+                Synthetic::Pixels<uint8_t> p = _visible.get(vr.pixels());
+                for (int y = 0; y < vr.height; ++y) {
+                    uint8_t *row = &(*p)[(size_t)y * vr.width];
+                    for (int x = 0; x < vr.width; ++x) {
+                        row[x] = (uint8_t)((((x + shift) / 16) & 1) ? 200 : 40) + (uint8_t)(y & 7);
+                    }
+                }
+                s.visibleFrame = Synthetic::VisibleFrame(t, vr.width, vr.height, p, _lens);
+            }
+            const Resolution& dr = _config.depth;
+            if (dr.enabled()) {
+                Synthetic::Pixels<float> p = _depth.get(dr.pixels());
+                for (int y = 0; y < dr.height; ++y) {
+                    float *row = &(*p)[(size_t)y * dr.width];
+                    for (int x = 0; x < dr.width; ++x) {
+                        row[x] = 800.0f + 2.0f * y + (float)(((x + shift) / 32) & 1) * 50.0f;
+                    }
+                }
+                s.depthFrame = Synthetic::DepthFrame(t, dr.width, dr.height, p);
+            }
+            const Resolution& ir = _config.infrared;
+            if (ir.enabled()) {
+                Synthetic::Pixels<uint16_t> p = _infrared.get(ir.pixels());
+                for (int y = 0; y < ir.height; ++y) {
+                    uint16_t *row = &(*p)[(size_t)y * ir.width];
+                    for (int x = 0; x < ir.width; ++x) {
+                        row[x] = (uint16_t)((((x + shift) / 16) & 1) ? 800 : 160);
+                    }
+                }
+                s.infraredFrame = Synthetic::InfraredFrame(t, ir.width, ir.height, p);
+            }
+            return s;
+        }
+
+        // Accel reads gravity plus a small wobble; gyro a slow yaw unless static
+        Sample accel(long index, double t) const {
+            Sample s;
+            s.type = Sample::Type::AccelerometerEvent;
+            Synthetic::Vector3 a;
+            a.x = _config.staticScene ? 0.0f : 0.1f * (float)(index % 7) / 7.0f;
+            a.y = -1.0f;
+            s.accelerometerEvent = Synthetic::AccelerometerEvent(t, a);
+            return s;
+        }
+
+        Sample gyro(double t) const {
+            Sample s;
+            s.type = Sample::Type::GyroscopeEvent;
+            Synthetic::Vector3 r;
+            r.y = _config.staticScene ? 0.0f : 0.3f;
+            s.gyroscopeEvent = Synthetic::GyroscopeEvent(t, r);
+            return s;
+        }
+
+    private:
+        const BenchConfig& _config;
+        std::shared_ptr<const Synthetic::Lens> _lens;
+        BufferPool<uint8_t> _visible;
+        BufferPool<float> _depth;
+        BufferPool<uint16_t> _infrared;
+    };
+
+    // Sends stdout to a file while the streamer target runs, so its per-sample
+    // log lines cost what logging to a file costs and stay out of the results
+    class StdoutRedirect {
+    public:
+        explicit StdoutRedirect(const std::string& path) {
+            fflush(stdout);
+            _saved = dup(STDOUT_FILENO);
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                fprintf(stderr, "Failed to open %s: %s\n", path.c_str(), strerror(errno));
+                exit(1);
+            }
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+
+        ~StdoutRedirect() {
+            std::cout.flush();
+            fflush(stdout);
+            dup2(_saved, STDOUT_FILENO);
+            close(_saved);
+        }
+
+    private:
+        int _saved = -1;
+    };
+}
+
+static bool parseResolution(const char *s, Resolution& r) {
+    return sscanf(s, "%dx%d", &r.width, &r.height) == 2;
+}
+
+static void parseOptions(BenchConfig& config, int argc, char **argv) {
+#define NEXT do { \
+    if (++i >= argc) { \
+        fprintf(stderr, "Expected argument after: %s\n", argv[i - 1]); \
+        fputs(usageMsg, stderr); \
+        exit(1); \
+    } \
+} while (0)
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            fputs(usageMsg, stdout);
+            exit(0);
+        }
+        else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--target")) {
+            NEXT;
+            if (!strcmp(argv[i], "streamer")) config.target = Target::Streamer;
+            else if (!strcmp(argv[i], "recorder")) config.target = Target::Recorder;
+            else {
+                fprintf(stderr, "Unknown target: %s\n", argv[i]);
+                fputs(usageMsg, stderr);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "-D") || !strcmp(argv[i], "--depth")) {
+            NEXT;
+            if (!parseResolution(argv[i], config.depth)) {
+                fprintf(stderr, "Bad resolution: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "-V") || !strcmp(argv[i], "--visible")) {
+            NEXT;
+            if (!parseResolution(argv[i], config.visible)) {
+                fprintf(stderr, "Bad resolution: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "-I") || !strcmp(argv[i], "--infrared")) {
+            NEXT;
+            if (!parseResolution(argv[i], config.infrared)) {
+                fprintf(stderr, "Bad resolution: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--frame-rate")) {
+            NEXT;
+            config.frameRate = std::stod(argv[i]);
+        }
+        else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--imu-rate")) {
+            NEXT;
+            config.imuRate = std::stod(argv[i]);
+        }
+        else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--frames")) {
+            NEXT;
+            config.frames = std::stoi(argv[i]);
+        }
+        else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
+            NEXT;
+            config.outputDir = argv[i];
+        }
+        else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--paced")) {
+            config.paced = true;
+        }
+        else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--static")) {
+            config.staticScene = true;
+        }
+        else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keyframes")) {
+            config.keyframes.enabled = true;
+        }
+        else if (!strcmp(argv[i], "-Q") || !strcmp(argv[i], "--queue-depth")) {
+            NEXT;
+            config.queueDepth = (size_t)std::max(1, std::stoi(argv[i]));
+        }
+        else if (!strcmp(argv[i], "--write-policy")) {
+            NEXT;
+            if (!parseQueuePolicy(argv[i], config.writePolicy)) {
+                fprintf(stderr, "Unknown queue policy: %s\n", argv[i]);
+                fputs(usageMsg, stderr);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--display")) {
+            config.display = true;
+        }
+        else if (!strcmp(argv[i], "--no-frame-sync")) {
+            config.frameSync = false;
+        }
+        else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--depth-correction")) {
+            config.depthCorrection = true;
+        }
+        else if (!strcmp(argv[i], "--correct-policy") || !strcmp(argv[i], "--record-policy")) {
+            NEXT;
+            bool record = !strcmp(argv[i - 1], "--record-policy");
+            QueuePolicy& policy = record ? config.recorder.recordPolicy : config.recorder.correctPolicy;
+            // The record stage has no optional work to skip, so degrade would just block
+            if (!parseQueuePolicy(argv[i], policy) || (record && policy == QueuePolicy::Degrade)) {
+                fprintf(stderr, "Unknown queue policy for %s: %s\n", argv[i - 1], argv[i]);
+                fputs(usageMsg, stderr);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--json")) {
+            config.json = true;
+        }
+        else {
+            fprintf(stderr, "Argument not understood: %s\n", argv[i]);
+            fputs(usageMsg, stderr);
+            exit(1);
+        }
+    }
+#undef NEXT
+    if (config.frameRate <= 0.0 || config.frames <= 0) {
+        fputs("Frame rate and frame count must be positive\n", stderr);
+        exit(1);
+    }
+    if (config.target == Target::Streamer) {
+        if (!config.queueDepth) {
+            config.queueDepth = 16;
+        }
+        if (!queuePolicyFits(config.writePolicy, config.queueDepth)) {
+            fputs("--write-policy degrade needs a queue depth of at least 2\n", stderr);
+            exit(1);
+        }
+        // SimpleStreamer writes a gray and a depth image for every synchronized keyframe
+        if (!config.visible.enabled() || !config.depth.enabled()) {
+            fputs("Visible and depth resolutions must be non-zero for the streamer target\n", stderr);
+            exit(1);
+        }
+        if (!config.frameSync) {
+            fputs("SimpleStreamer only handles synchronized frames; --no-frame-sync needs --target recorder\n", stderr);
+            exit(1);
+        }
+    }
+    else {
+        if (!config.queueDepth) {
+            config.queueDepth = 8;
+        }
+        config.recorder.queueDepth = config.queueDepth;
+        if (!queuePolicyFits(config.recorder.correctPolicy, config.queueDepth)) {
+            fputs("--correct-policy degrade needs a queue depth of at least 2\n", stderr);
+            exit(1);
+        }
+        if (!config.visible.enabled() && !config.depth.enabled() && !config.infrared.enabled()) {
+            fputs("At least one frame stream must have a non-zero resolution\n", stderr);
+            exit(1);
+        }
+    }
+}
+
+// Delivers every sample of the run on this thread, as the SDK callback
+// thread would, timing each delivery
+template <typename Deliver>
+static void deliverSamples(const BenchConfig& config, SampleGenerator& gen, Clock::time_point start,
+                           RunResult& r, Deliver deliver) {
+    double framePeriod = 1.0 / config.frameRate;
+    double imuPeriod = config.imuRate > 0.0 ? 1.0 / config.imuRate : 0.0;
+    double endTime = config.frames * framePeriod;
+    r.frames.usec.reserve((size_t)config.frames * (config.frameSync ? 1 : 3));
+    if (imuPeriod > 0.0) {
+        r.imu.usec.reserve((size_t)(2 * endTime / imuPeriod) + 2);
+    }
+
+    auto timed = [&](const Sample& sample, double t, double period, LatencyStats& stats) {
+        if (sample.depthFrame.isValid()) {
+            ++r.delivered[StreamBit::index(StreamBit::Depth)];
+        }
+        if (sample.visibleFrame.isValid()) {
+            ++r.delivered[StreamBit::index(StreamBit::Visible)];
+        }
+        if (sample.infraredFrame.isValid()) {
+            ++r.delivered[StreamBit::index(StreamBit::Infrared)];
+        }
+        if (sample.type == Sample::Type::AccelerometerEvent) {
+            ++r.delivered[StreamBit::index(StreamBit::Accel)];
+        }
+        else if (sample.type == Sample::Type::GyroscopeEvent) {
+            ++r.delivered[StreamBit::index(StreamBit::Gyro)];
+        }
+        auto t0 = Clock::now();
+        deliver(sample);
+        auto t1 = Clock::now();
+        stats.add(std::chrono::duration<double, std::micro>(t1 - t0).count());
+        if (config.paced) {
+            double behind = std::chrono::duration<double>(t0 - start).count() - t;
+            if (behind > 0.5 * period) {
+                ++stats.late;
+            }
+            if (std::chrono::duration<double>(t1 - t0).count() > period) {
+                ++stats.overrun;
+            }
+        }
+    };
+
+    int frameIndex = 0;
+    long imuIndex = 0;
+    while (frameIndex < config.frames) {
+        double nextFrame = frameIndex * framePeriod;
+        // Accel and gyro each run at imuRate, sharing timestamps
+        double nextImu = imuPeriod > 0.0 ? (imuIndex / 2) * imuPeriod : endTime;
+        bool isFrame = nextFrame <= nextImu;
+        double t = isFrame ? nextFrame : nextImu;
+
+        // Generation stands in for the SDK producing a sample; not timed
+        Sample sample = isFrame ? gen.frames(frameIndex, t)
+            : imuIndex % 2 == 0 ? gen.accel(imuIndex / 2, t) : gen.gyro(t);
+        if (config.paced) {
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(t)));
+        }
+
+        if (!isFrame) {
+            timed(sample, t, imuPeriod, r.imu);
+            ++imuIndex;
+            continue;
+        }
+        if (config.frameSync) {
+            timed(sample, t, framePeriod, r.frames);
+        }
+        else {
+            // Without frame sync each stream arrives as its own sample
+            Sample single;
+            if (sample.depthFrame.isValid()) {
+                single = Sample();
+                single.type = Sample::Type::DepthFrame;
+                single.depthFrame = sample.depthFrame;
+                timed(single, t, framePeriod, r.frames);
+            }
+            if (sample.visibleFrame.isValid()) {
+                single = Sample();
+                single.type = Sample::Type::VisibleFrame;
+                single.visibleFrame = sample.visibleFrame;
+                timed(single, t, framePeriod, r.frames);
+            }
+            if (sample.infraredFrame.isValid()) {
+                single = Sample();
+                single.type = Sample::Type::InfraredFrame;
+                single.infraredFrame = sample.infraredFrame;
+                timed(single, t, framePeriod, r.frames);
+            }
+        }
+        ++frameIndex;
+    }
+}
+
+static void runStreamer(const BenchConfig& config, RunResult& r) {
+    SampleWriter writer;
+    if (!writer.open(config.outputDir)) {
+        fprintf(stderr, "Failed to open output files in %s\n", config.outputDir.c_str());
+        exit(1);
+    }
+    SampleGenerator gen(config);
+    KeyframeGate gate(config.keyframes);
+    FramePipeline<SampleFrames<Sample>> pipeline(writer, gate, config.queueDepth, config.writePolicy, config.display);
+    StreamerOutput<Sample> output(pipeline);
+    output.setNominalRates(config.frameRate, config.frameRate);
+    pipeline.setWrittenCallback(endToEndRecorder(config, r));
+
+    {
+        StdoutRedirect log(config.outputDir + "/streamer.log");
+        std::thread writerThread([&pipeline]() { pipeline.runWriter(); });
+        unsigned long long allocsBefore = allocationCount.load();
+        auto start = Clock::now();
+        deliverSamples(config, gen, start, r, [&output](const Sample& sample) {
+            output.handleSample(sample);
+        });
+        r.deliverSec = std::chrono::duration<double>(Clock::now() - start).count();
+        pipeline.close();
+        writerThread.join();
+        r.wallSec = std::chrono::duration<double>(Clock::now() - start).count();
+        r.allocations = allocationCount.load() - allocsBefore;
+        output.printStats();
+    }
+
+    StageStats st = pipeline.stats();
+    r.framesWritten = pipeline.framesWritten();
+    // Keyframes carry depth and visible; IMU is written inline on delivery
+    // and infrared only logged
+    r.written[StreamBit::index(StreamBit::Depth)] = r.framesWritten;
+    r.written[StreamBit::index(StreamBit::Visible)] = r.framesWritten;
+    r.written[StreamBit::index(StreamBit::Accel)] = r.delivered[StreamBit::index(StreamBit::Accel)];
+    r.written[StreamBit::index(StreamBit::Gyro)] = r.delivered[StreamBit::index(StreamBit::Gyro)];
+    r.stages.push_back(st);
+    r.keyframes = gate.stats();
+    r.keyframesDropped = FramePipeline<SampleFrames<Sample>>::keyframesDropped(st);
+    r.displayFramesDropped = FramePipeline<SampleFrames<Sample>>::displayFramesDropped(st);
+}
+
+static void runRecorder(const BenchConfig& config, RunResult& r) {
+    mkdir(config.outputDir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    std::string occPath = config.outputDir + "/capture.occ";
+    Synthetic::OCCFileWriter occWriter;
+    if (!occWriter.startWritingToFile(occPath.c_str())) {
+        fprintf(stderr, "Failed to open %s\n", occPath.c_str());
+        exit(1);
+    }
+    SampleGenerator gen(config);
+    RecorderPipeline<Sample, Synthetic::OCCFileWriter> pipeline(config.recorder, config.keyframes);
+    pipeline.setDepthCorrection(config.depthCorrection);
+    pipeline.setWrittenCallback(endToEndRecorder(config, r));
+    pipeline.setNominalRate(StreamBit::Depth, config.frameRate);
+    pipeline.setNominalRate(StreamBit::Visible, config.frameRate);
+    pipeline.setNominalRate(StreamBit::Infrared, config.frameRate);
+    pipeline.setNominalRate(StreamBit::Accel, config.imuRate);
+    pipeline.setNominalRate(StreamBit::Gyro, config.imuRate);
+    pipeline.setWriter(&occWriter);
+
+    unsigned long long allocsBefore = allocationCount.load();
+    auto start = Clock::now();
+    pipeline.start();
+    deliverSamples(config, gen, start, r, [&pipeline](const Sample& sample) {
+        pipeline.submit(sample);
+    });
+    r.deliverSec = std::chrono::duration<double>(Clock::now() - start).count();
+    pipeline.stop();
+    r.wallSec = std::chrono::duration<double>(Clock::now() - start).count();
+    r.allocations = allocationCount.load() - allocsBefore;
+    pipeline.setWriter(nullptr);
+
+    for (int i = 0; i < StreamBit::count; ++i) {
+        r.written[i] = occWriter.written(1u << i);
+    }
+    r.framesWritten = std::max({occWriter.written(StreamBit::Depth), occWriter.written(StreamBit::Visible),
+        occWriter.written(StreamBit::Infrared)});
+    r.stages.push_back(pipeline.correctStats());
+    r.stages.push_back(pipeline.recordStats());
+    r.keyframes = pipeline.keyframeStats();
+}
+
+static long peakRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void printLatency(const char *name, LatencyStats& s, bool json, bool last) {
+    if (json) {
+        printf("    \"%s\": {\"count\": %zu, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+               "\"p99_us\": %.3f, \"max_us\": %.3f, \"late\": %llu, \"overrun\": %llu}%s\n",
+            name, s.usec.size(), s.mean(), s.percentile(0.5), s.percentile(0.9),
+            s.percentile(0.99), s.percentile(1.0), s.late, s.overrun, last ? "" : ",");
+    }
+    else {
+        printf("%-8s n=%-7zu mean %9.1f us  p50 %9.1f  p90 %9.1f  p99 %9.1f  max %9.1f  late %llu  overrun %llu\n",
+            name, s.usec.size(), s.mean(), s.percentile(0.5), s.percentile(0.9),
+            s.percentile(0.99), s.percentile(1.0), s.late, s.overrun);
+    }
+}
+
+static void printStreamCounts(const char *name, const unsigned long long *counts, bool last) {
+    printf("\"%s\": {", name);
+    for (int i = 0; i < StreamBit::count; ++i) {
+        printf("%s\"%s\": %llu", i ? ", " : "", StreamBit::names[i], counts[i]);
+    }
+    printf("}%s", last ? "" : ", ");
+}
+
+static void printStageJson(const StageStats& st, bool last) {
+    printf("    \"%s\": {\"policy\": \"%s\", \"capacity\": %zu, \"pushed\": %llu, \"max_depth\": %zu, \"blocked_ms\": %.3f, ",
+        st.name.c_str(), queuePolicyName(st.policy), st.capacity, st.pushed, st.maxDepth, st.blockedUsec / 1000.0);
+    printStreamCounts("dropped", st.dropped, false);
+    printStreamCounts("degraded", st.degraded, true);
+    printf("}%s\n", last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    parseOptions(config, argc, argv);
+
+    RunResult r;
+    bool streamer = config.target == Target::Streamer;
+    if (streamer) {
+        runStreamer(config, r);
+    }
+    else {
+        runRecorder(config, r);
+    }
+
+    size_t samples = r.frames.usec.size() + r.imu.usec.size();
+    double framesPerSec = r.wallSec > 0.0 ? r.framesWritten / r.wallSec : 0.0;
+    double samplesPerSec = r.wallSec > 0.0 ? samples / r.wallSec : 0.0;
+    double allocsPerSample = samples ? (double)r.allocations / samples : 0.0;
+
+    if (config.json) {
+        printf("{\n");
+        printf("  \"config\": {\"target\": \"%s\", \"depth\": \"%dx%d\", \"visible\": \"%dx%d\", \"infrared\": \"%dx%d\", "
+               "\"frame_rate\": %.3f, \"imu_rate\": %.3f, \"frames\": %d, \"paced\": %s, \"static\": %s, \"keyframes\": %s, "
+               "\"queue_depth\": %zu, ",
+            streamer ? "streamer" : "recorder",
+            config.depth.width, config.depth.height, config.visible.width, config.visible.height,
+            config.infrared.width, config.infrared.height, config.frameRate, config.imuRate, config.frames,
+            config.paced ? "true" : "false", config.staticScene ? "true" : "false",
+            config.keyframes.enabled ? "true" : "false", config.queueDepth);
+        if (streamer) {
+            printf("\"write_policy\": \"%s\", \"display\": %s},\n",
+                queuePolicyName(config.writePolicy), config.display ? "true" : "false");
+        }
+        else {
+            printf("\"frame_sync\": %s, \"depth_correction\": %s, \"correct_policy\": \"%s\", \"record_policy\": \"%s\"},\n",
+                config.frameSync ? "true" : "false", config.depthCorrection ? "true" : "false",
+                queuePolicyName(config.recorder.correctPolicy), queuePolicyName(config.recorder.recordPolicy));
+        }
+        printf("  \"latency\": {\n");
+        printLatency("frames", r.frames, true, false);
+        printLatency("imu", r.imu, true, true);
+        printf("  },\n");
+        printf("  \"end_to_end\": {\n");
+        printLatency("frames", r.framesEndToEnd, true, false);
+        printLatency("imu", r.imuEndToEnd, true, true);
+        printf("  },\n");
+        printf("  \"throughput\": {\"frames_written\": %llu, \"frames_written_per_sec\": %.3f, \"samples_per_sec\": %.3f, "
+               "\"deliver_sec\": %.6f, \"wall_sec\": %.6f},\n",
+            r.framesWritten, framesPerSec, samplesPerSec, r.deliverSec, r.wallSec);
+        printf("  \"streams\": {");
+        printStreamCounts("delivered", r.delivered, false);
+        printStreamCounts("written", r.written, true);
+        printf("},\n");
+        printf("  \"allocations\": {\"allocation_counter\": \"%s\", \"total\": %llu, \"per_sample\": %.2f},\n",
+            allocationCounter, r.allocations, allocsPerSample);
+        printf("  \"stages\": {\n");
+        for (size_t i = 0; i < r.stages.size(); ++i) {
+            printStageJson(r.stages[i], i + 1 == r.stages.size());
+        }
+        printf("  },\n");
+        if (streamer) {
+            printf("  \"writer\": {\"keyframes_written\": %llu, \"keyframes_dropped\": %llu, \"display_frames_dropped\": %llu},\n",
+                r.framesWritten, r.keyframesDropped, r.displayFramesDropped);
+        }
+        printf("  \"keyframes\": {\"kept\": %llu, \"skipped\": %llu, \"bytes_saved\": %llu},\n",
+            r.keyframes.framesKept, r.keyframes.framesSkipped, r.keyframes.bytesSaved);
+        printf("  \"peak_rss_kb\": %ld\n", peakRssKb());
+        printf("}\n");
+    }
+    else {
+        printf("Capture latency:\n");
+        printLatency("frames", r.frames, false, false);
+        printLatency("imu", r.imu, false, true);
+        printf("End-to-end latency (submit to written):\n");
+        printLatency("frames", r.framesEndToEnd, false, false);
+        printLatency("imu", r.imuEndToEnd, false, true);
+        printf("Throughput: %.1f frames written/s, %.1f samples/s (%.3f s delivering, %.3f s wall incl. drain)\n",
+            framesPerSec, samplesPerSec, r.deliverSec, r.wallSec);
+        printf("Streams (delivered/written):");
+        for (int i = 0; i < StreamBit::count; ++i) {
+            printf(" %s %llu/%llu", StreamBit::names[i], r.delivered[i], r.written[i]);
+        }
+        printf("\n");
+        for (const StageStats& st : r.stages) {
+            printf("Pipeline %s\n", st.describe().c_str());
+        }
+        if (streamer) {
+            printf("Write stage: %llu keyframes written, %llu keyframes dropped, %llu display-only frames dropped\n",
+                r.framesWritten, r.keyframesDropped, r.displayFramesDropped);
+        }
+        printf("Allocations (%s, all threads): %llu total, %.2f per sample\n",
+            allocationCounter, r.allocations, allocsPerSample);
+        if (config.keyframes.enabled) {
+            printf("Keyframes: kept %llu, skipped %llu, ~%.1f MB raw not written\n",
+                r.keyframes.framesKept, r.keyframes.framesSkipped, r.keyframes.bytesSaved / (1024.0 * 1024.0));
+        }
+        printf("Peak RSS: %ld KB\n", peakRssKb());
+    }
+    return 0;
+}
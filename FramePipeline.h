@@ -0,0 +1,251 @@
+#pragma once
+
+#include "KeyframeGate.h"
+#include "Pipeline.h"
+#include "SampleWriter.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <stdio.h>
+
+// SimpleStreamer's frame path: the capture thread runs the keyframe gate and
+// queues frames; a writer stage undistorts, displays and writes them.
+//
+// `Frames` adapts one synchronized capture and must provide:
+//   double timestamp() const;
+//   const unsigned char *gray() const; int grayWidth() const; int grayHeight() const;
+//   const float *depthMm() const; int depthWidth() const; int depthHeight() const;
+//   void undistort();  // afterwards gray() returns the undistorted image
+//
+// Keyframes are queued as non-droppable, so under drop-oldest only
+// display-only frames are discarded and the gate's kept count matches what
+// is written. Under degrade the writer skips display; it always undistorts so
+// the dataset uses a single camera model.
+template <typename Frames>
+class FramePipeline {
+public:
+    FramePipeline(SampleWriter& writer, KeyframeGate& gate, size_t queueDepth, QueuePolicy policy, bool display)
+        : _writer(writer), _gate(gate), _display(display), _queue("write", queueDepth, policy) {}
+
+    // Called on the writer thread for each keyframe written, with the time
+    // since submitFrames() in microseconds
+    void setWrittenCallback(std::function<void(unsigned streams, double usec)> written) {
+        _written = written;
+    }
+
+    // Capture side. Returns false if the pipeline was closed.
+    bool submitFrames(const Frames& frames) {
+        // Raw size of what we would write: 8-bit gray plus 16-bit depth
+        size_t bytes = (size_t)frames.grayWidth() * frames.grayHeight()
+            + (size_t)frames.depthWidth() * frames.depthHeight() * 2;
+        Job job;
+        job.frames = frames;
+        job.submitted = std::chrono::steady_clock::now();
+        job.keyframe = _gate.shouldKeep(frames.timestamp(), frames.gray(),
+            frames.grayWidth(), frames.grayHeight(), 1.0f, bytes);
+        if (job.keyframe) {
+            return _queue.push(job, StreamBit::Depth | StreamBit::Visible, false);
+        }
+        else if (_display) {
+            return _queue.push(job, StreamBit::Visible, true);
+        }
+        return true;
+    }
+
+    // IMU is written inline at full rate and only feeds the gate
+    void submitAccel(double timestamp, float x, float y, float z) {
+        _gate.accelSample(x, y, z);
+        _writer.writeAccel(timestamp, x, y, z);
+    }
+
+    void submitGyro(double timestamp, float x, float y, float z) {
+        _gate.gyroSample(x, y, z);
+        _writer.writeGyro(timestamp, x, y, z);
+    }
+
+    // Writer stage; returns once close() was called and the queue is drained
+    void runWriter() {
+        Job job;
+        bool degrade = false;
+        auto lastReport = std::chrono::steady_clock::now();
+        unsigned long long reportedLoss = 0;
+        while (_queue.pop(job, degrade)) {
+            bool show = _display && !degrade;
+            if (_display && degrade) {
+                // Only the visible image is displayed
+                _queue.countDegraded(StreamBit::Visible);
+            }
+            if (job.keyframe || show) {
+                job.frames.undistort();
+            }
+            if (show) {
+                cv::Mat I_g(job.frames.grayHeight(), job.frames.grayWidth(), CV_8UC1, (void*)job.frames.gray());
+                cv::imshow("window", I_g);
+                cv::waitKey(1);
+            }
+            if (job.keyframe) {
+                _writer.writeFrames(job.frames.timestamp(), job.frames.gray(), job.frames.grayWidth(), job.frames.grayHeight(),
+                    job.frames.depthMm(), job.frames.depthWidth(), job.frames.depthHeight());
+                ++_framesWritten;
+                if (_written) {
+                    _written(StreamBit::Depth | StreamBit::Visible, std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - job.submitted).count());
+                }
+            }
+            job = Job(); // Release the frame buffers before waiting
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastReport >= std::chrono::seconds(5)) {
+                StageStats st = _queue.stats();
+                unsigned long long loss = st.totalDropped() + st.totalDegraded();
+                if (loss != reportedLoss) {
+                    printf("Pipeline %s\n", st.describe().c_str());
+                    reportedLoss = loss;
+                }
+                lastReport = now;
+            }
+        }
+    }
+
+    void close() {
+        _queue.close();
+    }
+
+    StageStats stats() const {
+        return _queue.stats();
+    }
+
+    unsigned long long framesWritten() const {
+        return _framesWritten;
+    }
+
+    // Only keyframes are queued with depth, so the depth drop count is the
+    // keyframe drop count; the rest of the visible drops are display-only frames
+    static unsigned long long keyframesDropped(const StageStats& st) {
+        return st.dropped[StreamBit::index(StreamBit::Depth)];
+    }
+
+    static unsigned long long displayFramesDropped(const StageStats& st) {
+        return st.dropped[StreamBit::index(StreamBit::Visible)] - keyframesDropped(st);
+    }
+
+    void printStats() const {
+        StageStats st = stats();
+        printf("Pipeline %s\n", st.describe().c_str());
+        printf("Write stage: %llu keyframes written, %llu keyframes dropped, %llu display-only frames dropped\n",
+            framesWritten(), keyframesDropped(st), displayFramesDropped(st));
+    }
+
+private:
+    struct Job {
+        Frames frames;
+        bool keyframe = true;
+        std::chrono::steady_clock::time_point submitted;
+    };
+
+    SampleWriter& _writer;
+    KeyframeGate& _gate;
+    bool _display;
+    std::function<void(unsigned, double)> _written;
+    BoundedQueue<Job> _queue;
+    std::atomic<unsigned long long> _framesWritten{0};
+};
+
+// Adapts a synchronized capture sample (ST::CaptureSessionSample, or the
+// benchmark's synthetic one) for FramePipeline
+template <typename Sample>
+struct SampleFrames {
+    Sample sample;
+    decltype(Sample::visibleFrame) undistorted;
+    bool isUndistorted = false;
+
+    double timestamp() const { return sample.visibleFrame.timestamp(); }
+    const unsigned char *gray() const { return isUndistorted ? undistorted.yData() : sample.visibleFrame.yData(); }
+    int grayWidth() const { return sample.visibleFrame.width(); }
+    int grayHeight() const { return sample.visibleFrame.height(); }
+    const float *depthMm() const { return sample.depthFrame.depthInMillimeters(); }
+    int depthWidth() const { return sample.depthFrame.width(); }
+    int depthHeight() const { return sample.depthFrame.height(); }
+
+    void undistort() {
+        if (!isUndistorted) {
+            undistorted = sample.visibleFrame.undistorted();
+            isUndistorted = true;
+        }
+    }
+};
+
+// SimpleStreamer's SDK callback: logs each sample to stdout, counts upstream
+// gaps and hands synchronized frames and IMU events to the FramePipeline
+template <typename Sample>
+class StreamerOutput {
+public:
+    using Type = typename Sample::Type;
+
+    explicit StreamerOutput(FramePipeline<SampleFrames<Sample>>& pipeline) : _pipeline(pipeline) {}
+
+    void setNominalRates(double depthHz, double visibleHz) {
+        _upstreamDepthDrops.setNominalRate(depthHz);
+        _upstreamVisibleDrops.setNominalRate(visibleHz);
+    }
+
+    void handleSample(const Sample& sample) {
+        // printf("Received capture session sample of type %d (%s)\n", (int)sample.type, ST::CaptureSessionSample::toString(sample.type));
+        switch (sample.type) {
+            case Type::DepthFrame:
+                printf("Depth frame: size %dx%d\n", sample.depthFrame.width(), sample.depthFrame.height());
+                break;
+            case Type::VisibleFrame:
+                printf("Visible frame: size %dx%d\n", sample.visibleFrame.width(), sample.visibleFrame.height());
+                break;
+            case Type::InfraredFrame:
+                printf("Infrared frame: size %dx%d\n", sample.infraredFrame.width(), sample.infraredFrame.height());
+                break;
+            case Type::SynchronizedFrames:
+                printf("Synchronized frames: depth %dx%d visible %dx%d infrared %dx%d\n", sample.depthFrame.width(), sample.depthFrame.height(), sample.visibleFrame.width(), sample.visibleFrame.height(), sample.infraredFrame.width(), sample.infraredFrame.height());
+                // printf("Depth frame: timestamp %.9f\n",sample.depthFrame.timestamp() );
+                // printf("Visible frame: timestamp %.9f\n",sample.visibleFrame.timestamp() );
+                // cout << sample.visibleFrame.glProjectionMatrix()<<endl;
+
+                std::cout << ( sample.visibleFrame.intrinsics() ).cx <<" "<< ( sample.visibleFrame.intrinsics() ).cy <<" "<< ( sample.visibleFrame.intrinsics() ).fx <<" "<< ( sample.visibleFrame.intrinsics() ).fy <<" "<<std::endl;
+
+                // cout << sample.depthFrame.glProjectionMatrix()<<endl;
+                std::cout << sample.depthFrame.colorCameraPoseInDepthCoordinateFrame()<<std::endl;
+
+                _upstreamDepthDrops.tick(sample.depthFrame.timestamp());
+                _upstreamVisibleDrops.tick(sample.visibleFrame.timestamp());
+                {
+                    // Gate on the raw image; undistortion happens in the writer stage
+                    SampleFrames<Sample> frames;
+                    frames.sample = sample;
+                    _pipeline.submitFrames(frames);
+                }
+                break;
+            case Type::AccelerometerEvent:
+                // printf("Accelerometer event: [% .9f %.5f % .5f % .5f]\n", sample.accelerometerEvent.timestamp(), sample.accelerometerEvent.acceleration().x, sample.accelerometerEvent.acceleration().y, sample.accelerometerEvent.acceleration().z);
+                _pipeline.submitAccel(sample.accelerometerEvent.timestamp(), sample.accelerometerEvent.acceleration().x, sample.accelerometerEvent.acceleration().y, sample.accelerometerEvent.acceleration().z);
+                break;
+            case Type::GyroscopeEvent:
+                // printf("Gyroscope event: [% .9f % .5f % .5f % .5f]\n", sample.gyroscopeEvent.timestamp(), sample.gyroscopeEvent.rotationRate().x, sample.gyroscopeEvent.rotationRate().y, sample.gyroscopeEvent.rotationRate().z);
+                _pipeline.submitGyro(sample.gyroscopeEvent.timestamp(), sample.gyroscopeEvent.rotationRate().x, sample.gyroscopeEvent.rotationRate().y, sample.gyroscopeEvent.rotationRate().z);
+                break;
+            default:
+                printf("Sample type %d unhandled\n", (int)sample.type);
+        }
+    }
+
+    void printStats() const {
+        _pipeline.printStats();
+        printf("Upstream drops (timestamp gaps): depth %llu visible %llu\n",
+            _upstreamDepthDrops.dropped(), _upstreamVisibleDrops.dropped());
+    }
+
+private:
+    FramePipeline<SampleFrames<Sample>>& _pipeline;
+    UpstreamDropCounter _upstreamDepthDrops;
+    UpstreamDropCounter _upstreamVisibleDrops;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Decides whether a frame is worth persisting. A frame is kept when the rig
+// is moving (gyroscope rate or accelerometer deviation above threshold), when
+// the image differs enough from the last kept frame, or when maxInterval has
+// elapsed since the last keyframe. IMU samples are never gated.
+struct KeyframeGateConfig {
+    bool enabled = false;
+    float gyroThreshold = 0.05f;   // rad/s, peak rotation rate magnitude
+    float accelThreshold = 0.05f;  // g, peak deviation from the gravity baseline
+    float diffThreshold = 6.0f;    // mean absolute difference on a 0-255 scale
+    double maxInterval = 1.0;      // seconds between forced keyframes
+    int subsample = 8;             // pixel step for the frame-difference score
+};
+
+struct KeyframeGateStats {
+    unsigned long long framesKept = 0;
+    unsigned long long framesSkipped = 0;
+    unsigned long long bytesSaved = 0;
+};
+
+class KeyframeGate {
+public:
+    explicit KeyframeGate(const KeyframeGateConfig& config = KeyframeGateConfig()) : _config(config) {}
+
+    const KeyframeGateConfig& config() const { return _config; }
+    const KeyframeGateStats& stats() const { return _stats; }
+
+    void gyroSample(float x, float y, float z) {
+        float rate = sqrtf(x * x + y * y + z * z);
+        if (rate > _gyroPeak) {
+            _gyroPeak = rate;
+        }
+    }
+
+    void accelSample(float x, float y, float z) {
+        if (!_haveGravity) {
+            _gravity[0] = x; _gravity[1] = y; _gravity[2] = z;
+            _haveGravity = true;
+            return;
+        }
+        float dx = x - _gravity[0], dy = y - _gravity[1], dz = z - _gravity[2];
+        float dev = sqrtf(dx * dx + dy * dy + dz * dz);
+        if (dev > _accelPeak) {
+            _accelPeak = dev;
+        }
+        // Slow low-pass so the baseline tracks gravity, not motion
+        const float alpha = 0.02f;
+        _gravity[0] += alpha * dx; _gravity[1] += alpha * dy; _gravity[2] += alpha * dz;
+    }
+
+    // Returns true if the frame should be written. `scale` maps pixel values
+    // onto a 0-255 range; pass data == nullptr to gate on IMU and time alone.
+    // `frameBytes` is added to bytesSaved when the frame is skipped.
+    template <typename T>
+    bool shouldKeep(double timestamp, const T *data, int width, int height, float scale, size_t frameBytes) {
+        if (!_config.enabled) {
+            // Every frame is kept; skip the thumbnail so a disabled gate costs nothing
+            ++_stats.framesKept;
+            return true;
+        }
+
+        bool keep = !_haveKeyframe
+            || timestamp - _lastKeyTime >= _config.maxInterval
+            || timestamp < _lastKeyTime
+            || _gyroPeak > _config.gyroThreshold
+            || _accelPeak > _config.accelThreshold;
+
+        if (data) {
+            sampleThumbnail(data, width, height, scale);
+            if (!keep) {
+                keep = differenceScore() > _config.diffThreshold;
+            }
+            if (keep) {
+                _keyThumb.swap(_thumb);
+            }
+        }
+
+        _gyroPeak = 0.0f;
+        _accelPeak = 0.0f;
+        if (keep) {
+            _haveKeyframe = true;
+            _lastKeyTime = timestamp;
+            ++_stats.framesKept;
+        }
+        else {
+            ++_stats.framesSkipped;
+            _stats.bytesSaved += frameBytes;
+        }
+        return keep;
+    }
+
+    bool shouldKeep(double timestamp, size_t frameBytes) {
+        return shouldKeep<uint8_t>(timestamp, nullptr, 0, 0, 1.0f, frameBytes);
+    }
+
+    // Accounts for a frame that follows another frame's decision, e.g. the
+    // depth frame captured at the same instant as a gated visible frame
+    void countFollower(bool keep, size_t frameBytes) {
+        if (keep) {
+            ++_stats.framesKept;
+        }
+        else {
+            ++_stats.framesSkipped;
+            _stats.bytesSaved += frameBytes;
+        }
+    }
+
+    void reset() {
+        _haveKeyframe = false;
+        _haveGravity = false;
+        _gyroPeak = 0.0f;
+        _accelPeak = 0.0f;
+        _thumb.clear();
+        _keyThumb.clear();
+        _stats = KeyframeGateStats();
+    }
+
+private:
+    template <typename T>
+    void sampleThumbnail(const T *data, int width, int height, float scale) {
+        int step = _config.subsample > 0 ? _config.subsample : 1;
+        _thumb.clear();
+        for (int y = 0; y < height; y += step) {
+            const T *row = data + (size_t)y * width;
+            for (int x = 0; x < width; x += step) {
+                _thumb.push_back((float)row[x] * scale);
+            }
+        }
+    }
+
+    float differenceScore() const {
+        if (_thumb.empty() || _thumb.size() != _keyThumb.size()) {
+            // Resolution change or first image: treat as maximally different
+            return INFINITY;
+        }
+        double sum = 0.0;
+        size_t n = 0;
+        for (size_t i = 0; i < _thumb.size(); ++i) {
+            float d = _thumb[i] - _keyThumb[i];
+            if (isfinite(d)) {
+                sum += fabsf(d);
+                ++n;
+            }
+        }
+        return n ? (float)(sum / n) : 0.0f;
+    }
+
+    KeyframeGateConfig _config;
+    KeyframeGateStats _stats;
+
+    bool _haveKeyframe = false;
+    double _lastKeyTime = 0.0;
+    float _gyroPeak = 0.0f;
+    float _accelPeak = 0.0f;
+    bool _haveGravity = false;
+    float _gravity[3] = {0.0f, 0.0f, 0.0f};
+
+    std::vector<float> _thumb;
+    std::vector<float> _keyThumb;
+};
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+
+// What a full queue does to its producer:
+//   Block: producer waits for space (no loss, back-pressure reaches the SDK thread)
+//   DropOldest: oldest droppable entry is discarded to make room
+//   Degrade: producer waits like Block, but the consumer is told to skip optional
+//            work while the queue is at least half full. Behaves as Block for
+//            stages that have no optional work, and needs a capacity of at
+//            least 2 so there is room for entries waiting behind the current one.
+enum class QueuePolicy {
+    Block,
+    DropOldest,
+    Degrade,
+};
+
+static inline const char *queuePolicyName(QueuePolicy policy) {
+    switch (policy) {
+        case QueuePolicy::Block: return "block";
+        case QueuePolicy::DropOldest: return "drop-oldest";
+        case QueuePolicy::Degrade: return "degrade";
+    }
+    return "unknown";
+}
+
+static inline bool parseQueuePolicy(const char *s, QueuePolicy& policy) {
+    if (!strcmp(s, "block")) policy = QueuePolicy::Block;
+    else if (!strcmp(s, "drop-oldest")) policy = QueuePolicy::DropOldest;
+    else if (!strcmp(s, "degrade")) policy = QueuePolicy::Degrade;
+    else return false;
+    return true;
+}
+
+// A one-deep Degrade queue never has anything behind the entry being popped,
+// so it would silently behave as Block
+static inline bool queuePolicyFits(QueuePolicy policy, size_t capacity) {
+    return policy != QueuePolicy::Degrade || capacity >= 2;
+}
+
+// Bit per stream so one synchronized sample can be attributed to several
+namespace StreamBit {
+    enum : unsigned {
+        Depth = 1 << 0,
+        Visible = 1 << 1,
+        Infrared = 1 << 2,
+        Accel = 1 << 3,
+        Gyro = 1 << 4,
+    };
+    static const int count = 5;
+    static const char *const names[count] = {"depth", "visible", "infrared", "accel", "gyro"};
+
+    // Index into per-stream arrays for a single stream bit
+    static inline int index(unsigned bit) {
+        for (int i = 0; i < count; ++i) {
+            if (bit == (1u << i)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+}
+
+// " depth 3 visible 1" for the non-zero entries of a per-stream array, or " none"
+static inline std::string describeStreamCounts(const unsigned long long *counts) {
+    std::string s;
+    for (int i = 0; i < StreamBit::count; ++i) {
+        if (counts[i]) {
+            s += " " + std::string(StreamBit::names[i]) + " " + std::to_string(counts[i]);
+        }
+    }
+    return s.empty() ? " none" : s;
+}
+
+struct StageStats {
+    std::string name;
+    QueuePolicy policy = QueuePolicy::Block;
+    size_t capacity = 0;
+    size_t maxDepth = 0;
+    unsigned long long pushed = 0;
+    unsigned long long blockedUsec = 0;
+    unsigned long long dropped[StreamBit::count] = {};
+    unsigned long long degraded[StreamBit::count] = {};
+
+    unsigned long long totalDropped() const {
+        unsigned long long n = 0;
+        for (int i = 0; i < StreamBit::count; ++i) n += dropped[i];
+        return n;
+    }
+    unsigned long long totalDegraded() const {
+        unsigned long long n = 0;
+        for (int i = 0; i < StreamBit::count; ++i) n += degraded[i];
+        return n;
+    }
+
+    // e.g. "correct (degrade, 8): 1200 in, max depth 8, blocked 12.3 ms, dropped none, degraded depth 10"
+    std::string describe() const {
+        char buf[512];
+        int n = snprintf(buf, sizeof(buf), "%s (%s, %zu): %llu in, max depth %zu, blocked %.1f ms",
+            name.c_str(), queuePolicyName(policy), capacity, pushed, maxDepth, blockedUsec / 1000.0);
+        std::string s(buf, n > 0 ? (size_t)n : 0);
+        s += ", dropped" + describeStreamCounts(dropped);
+        s += ", degraded" + describeStreamCounts(degraded);
+        return s;
+    }
+};
+
+// Fixed-capacity FIFO joining two pipeline stages. Drops and degraded
+// deliveries are counted per stream using the mask given at push time.
+template <typename T>
+class BoundedQueue {
+public:
+    BoundedQueue(const char *name, size_t capacity, QueuePolicy policy) {
+        _stats.name = name;
+        _stats.capacity = capacity > 0 ? capacity : 1;
+        _stats.policy = policy;
+    }
+
+    // Entries that are not droppable (e.g. IMU) are never discarded; if a
+    // DropOldest queue is full of them the producer blocks instead.
+    // Returns false if the queue was closed.
+    bool push(T item, unsigned streams, bool droppable = true) {
+        std::unique_lock<std::mutex> u(_lock);
+        if (_closed) {
+            return false;
+        }
+        if (_items.size() >= _stats.capacity && _stats.policy == QueuePolicy::DropOldest) {
+            for (auto it = _items.begin(); it != _items.end(); ++it) {
+                if (it->droppable) {
+                    count(_stats.dropped, it->streams);
+                    _items.erase(it);
+                    break;
+                }
+            }
+        }
+        if (_items.size() >= _stats.capacity) {
+            auto start = std::chrono::steady_clock::now();
+            _notFull.wait(u, [this]() {
+                return _closed || _items.size() < _stats.capacity;
+            });
+            _stats.blockedUsec += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            if (_closed) {
+                return false;
+            }
+        }
+        _items.push_back(Entry{std::move(item), streams, droppable});
+        ++_stats.pushed;
+        if (_items.size() > _stats.maxDepth) {
+            _stats.maxDepth = _items.size();
+        }
+        _notEmpty.notify_one();
+        return true;
+    }
+
+    // Blocks until an entry is available. Returns false once closed and
+    // drained. `degrade` is set when a Degrade queue is backed up; the
+    // consumer reports what it actually skipped with countDegraded().
+    bool pop(T& item, bool& degrade) {
+        std::unique_lock<std::mutex> u(_lock);
+        _notEmpty.wait(u, [this]() {
+            return _closed || !_items.empty();
+        });
+        if (_items.empty()) {
+            return false;
+        }
+        Entry& e = _items.front();
+        size_t behind = _items.size() - 1;
+        degrade = _stats.policy == QueuePolicy::Degrade && behind > 0 && behind * 2 >= _stats.capacity;
+        item = std::move(e.item);
+        _items.pop_front();
+        _notFull.notify_one();
+        return true;
+    }
+
+    void countDegraded(unsigned streams) {
+        std::unique_lock<std::mutex> u(_lock);
+        count(_stats.degraded, streams);
+    }
+
+    // Wakes all waiters; remaining entries can still be popped
+    void close() {
+        std::unique_lock<std::mutex> u(_lock);
+        _closed = true;
+        _notFull.notify_all();
+        _notEmpty.notify_all();
+    }
+
+    StageStats stats() const {
+        std::unique_lock<std::mutex> u(_lock);
+        return _stats;
+    }
+
+private:
+    struct Entry {
+        T item;
+        unsigned streams;
+        bool droppable;
+    };
+
+    static void count(unsigned long long *counts, unsigned streams) {
+        for (int i = 0; i < StreamBit::count; ++i) {
+            if (streams & (1u << i)) {
+                ++counts[i];
+            }
+        }
+    }
+
+    mutable std::mutex _lock;
+    std::condition_variable _notFull;
+    std::condition_variable _notEmpty;
+    std::deque<Entry> _items;
+    bool _closed = false;
+    StageStats _stats;
+};
+
+// Estimates frames lost before they reached us from gaps in sensor
+// timestamps. The reference interval is the stream's nominal rate from the
+// session settings when known. Otherwise it is seeded from the shortest of the
+// first few intervals and smoothed over gap-free intervals only. A run of
+// equal gaps is never taken for a rate change, so sustained loss (e.g. every
+// other frame under overload) keeps being counted.
+class UpstreamDropCounter {
+public:
+    // Hz; 0 when the rate is not known up front (e.g. OCC playback)
+    void setNominalRate(double hz) {
+        _nominalInterval = hz > 0.0 ? 1.0 / hz : 0.0;
+    }
+
+    void tick(double timestamp) {
+        if (_haveLast) {
+            double dt = timestamp - _last;
+            if (dt > 0.0) {
+                interval(dt);
+            }
+        }
+        _haveLast = true;
+        _last = timestamp;
+    }
+
+    unsigned long long dropped() const { return _dropped; }
+
+    // Keeps the nominal rate
+    void reset() {
+        _haveLast = false;
+        _seedCount = 0;
+        _interval = 0.0;
+        _dropped = 0;
+    }
+
+private:
+    static const int seedIntervals = 4;
+
+    void interval(double dt) {
+        if (_nominalInterval > 0.0) {
+            _interval = _nominalInterval;
+        }
+        else if (_seedCount < seedIntervals) {
+            _interval = _seedCount == 0 ? dt : fmin(_interval, dt);
+            ++_seedCount;
+            return;
+        }
+        if (dt <= 1.5 * _interval) {
+            if (_nominalInterval <= 0.0) {
+                _interval = 0.9 * _interval + 0.1 * dt;
+            }
+            return;
+        }
+        _dropped += (unsigned long long)llround(dt / _interval) - 1;
+    }
+
+    bool _haveLast = false;
+    double _last = 0.0;
+    double _nominalInterval = 0.0;
+    int _seedCount = 0;
+    double _interval = 0.0;
+    unsigned long long _dropped = 0;
+};
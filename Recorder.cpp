@@ -1,10 +1,13 @@
 #include "Recorder.h"
+#include "RecorderPipeline.h"
 #include <SampleCode/SampleCode.h>
 #include <ST/CameraFrames.h>
 #include <ST/CaptureSession.h>
 #include <ST/OCCFileWriter.h>
 
+#include <algorithm>
 #include <condition_variable>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <string.h>
@@ -33,9 +36,17 @@ static const char usageMsg[] =
     "-t/--time <milliseconds>: How long to stream from device or OCC; no limit if negative (default)\n"
     "-x/--exit-on-end: Exit at end of OCC or --time duration\n"
     "--no-frame-sync: Do not synchronize frames from device or OCC\n"
+    "-k/--keyframes: Only record frames to OCC when the rig moves or the scene changes (IMU is always recorded)\n"
+    "--kf-gyro <rad/s>: Keyframe gyroscope rate threshold (default 0.05)\n"
+    "--kf-accel <g>: Keyframe accelerometer deviation threshold (default 0.05)\n"
+    "--kf-diff <0-255>: Keyframe mean frame difference threshold (default 6)\n"
+    "--kf-interval <seconds>: Maximum time between keyframes (default 1)\n"
+    "-Q/--queue-depth <n>: Capacity of each capture pipeline queue (default 8)\n"
+    "--correct-policy <block|drop-oldest|degrade>: When depth correction falls behind (default block; degrade records uncorrected depth)\n"
+    "--record-policy <block|drop-oldest>: When OCC writing falls behind (default block)\n"
     "";
 
-static void parseOptions(AppConfig& config, int argc, char **argv) {
+static void parseOptions(AppConfig& config, KeyframeGateConfig& keyframes, PipelineConfig& pipeline, int argc, char **argv) {
 #define NEXT do { \
     if (++i >= argc) { \
         fprintf(stderr, "Expected argument after: %s\n", argv[i - 1]); \
@@ -107,6 +118,40 @@ static void parseOptions(AppConfig& config, int argc, char **argv) {
         else if (!strcmp(argv[i], "--no-frame-sync")) {
             config.streaming.frameSync = false;
         }
+        else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keyframes")) {
+            keyframes.enabled = true;
+        }
+        else if (!strcmp(argv[i], "--kf-gyro")) {
+            NEXT;
+            keyframes.gyroThreshold = std::stof(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--kf-accel")) {
+            NEXT;
+            keyframes.accelThreshold = std::stof(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--kf-diff")) {
+            NEXT;
+            keyframes.diffThreshold = std::stof(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--kf-interval")) {
+            NEXT;
+            keyframes.maxInterval = std::stod(argv[i]);
+        }
+        else if (!strcmp(argv[i], "-Q") || !strcmp(argv[i], "--queue-depth")) {
+            NEXT;
+            pipeline.queueDepth = (size_t)std::max(1, std::stoi(argv[i]));
+        }
+        else if (!strcmp(argv[i], "--correct-policy") || !strcmp(argv[i], "--record-policy")) {
+            NEXT;
+            bool record = !strcmp(argv[i - 1], "--record-policy");
+            QueuePolicy& policy = record ? pipeline.recordPolicy : pipeline.correctPolicy;
+            // The record stage has no optional work to skip, so degrade would just block
+            if (!parseQueuePolicy(argv[i], policy) || (record && policy == QueuePolicy::Degrade)) {
+                fprintf(stderr, "Unknown queue policy for %s: %s\n", argv[i - 1], argv[i]);
+                fputs(usageMsg, stderr);
+                exit(1);
+            }
+        }
         else {
             fprintf(stderr, "Argument not understood: %s\n", argv[i]);
             fputs(usageMsg, stderr);
@@ -114,6 +159,10 @@ static void parseOptions(AppConfig& config, int argc, char **argv) {
         }
     }
 #undef NEXT
+    if (!queuePolicyFits(pipeline.correctPolicy, pipeline.queueDepth)) {
+        fputs("--correct-policy degrade needs a queue depth of at least 2\n", stderr);
+        exit(1);
+    }
 }
 
 static ST::CaptureSessionSettings sessionSettingsForConfig(const AppConfig& config) {
@@ -163,7 +212,19 @@ static ST::CaptureSessionSettings sessionSettingsForConfig(const AppConfig& conf
     return settings;
 }
 
+static double imuRateHz(ST::StructureCoreIMUUpdateRate rate) {
+    switch (rate) {
+        case ST::StructureCoreIMUUpdateRate::AccelAndGyro_100Hz: return 100.0;
+        case ST::StructureCoreIMUUpdateRate::AccelAndGyro_200Hz: return 200.0;
+        case ST::StructureCoreIMUUpdateRate::AccelAndGyro_800Hz: return 800.0;
+        case ST::StructureCoreIMUUpdateRate::AccelAndGyro_1000Hz: return 1000.0;
+        default: return 0.0;
+    }
+}
+
 namespace {
+    using SamplePipeline = RecorderPipeline<ST::CaptureSessionSample, ST::OCCFileWriter>;
+
     struct SessionContext {
         std::unique_ptr<RecorderGui> gui;
 
@@ -179,7 +240,6 @@ namespace {
         bool haveFirstSample = false;
         std::chrono::steady_clock::time_point lastSampleTime;
 
-        std::mutex occWriterLock;
         std::unique_ptr<ST::OCCFileWriter> occWriter;
 
         RateMonitor depthMonitor;
@@ -188,6 +248,10 @@ namespace {
         RateMonitor accelMonitor;
         RateMonitor gyroMonitor;
 
+        // Correction and OCC recording run on their own threads, fed by the
+        // SDK callback; started before startStreaming() and drained after stopStreaming()
+        std::unique_ptr<SamplePipeline> pipeline;
+
         void reset() {
             readyToStream = false;
             endOfStream = false;
@@ -212,64 +276,77 @@ static void handleSessionEvent(SessionContext& ctx, ST::CaptureSessionEventId ev
     ctx.cond.notify_all();
 }
 
-static void handleSessionOutput(SessionContext& ctx, const ST::CaptureSessionSample& sample) {
-    Log::logv("New sample of type %d: %s", (int)sample.type, ST::CaptureSessionSample::toString(sample.type));
+// Upstream drops are measured against the configured rates. OCC playback
+// has no nominal rate, so those counters learn it from the first frames.
+static void setNominalRates(SamplePipeline& pipeline, const AppConfig& config, const ST::CaptureSessionSettings& settings) {
+    bool sensor = config.streaming.source == StreamingSource::Sensor;
+    const auto& sc = settings.structureCore;
+    pipeline.setNominalRate(StreamBit::Depth, sensor ? sc.depthFramerate : 0.0);
+    pipeline.setNominalRate(StreamBit::Visible, sensor ? sc.visibleFramerate : 0.0);
+    pipeline.setNominalRate(StreamBit::Infrared, sensor ? sc.infraredFramerate : 0.0);
+    double imuRate = sensor ? imuRateHz(sc.imuUpdateRate) : 0.0;
+    pipeline.setNominalRate(StreamBit::Accel, imuRate);
+    pipeline.setNominalRate(StreamBit::Gyro, imuRate);
+}
+
+static void logPipelineStats(const SamplePipeline& pipeline) {
+    Log::log("Pipeline %s", pipeline.correctStats().describe().c_str());
+    Log::log("Pipeline %s", pipeline.recordStats().describe().c_str());
+    Log::log("Upstream drops (timestamp gaps):%s", pipeline.describeUpstreamDrops().c_str());
+}
 
-    bool depthCorrectionEnabled = false;
+// Call with ctx.lock held
+static void updateSampleSet(SessionContext& ctx, const ST::CaptureSessionSample& sample) {
+    switch (sample.type) {
+        case ST::CaptureSessionSample::Type::AccelerometerEvent:
+            ctx.samples.accel.newSample(sample.accelerometerEvent, ctx.accelMonitor.rate());
+            return;
+        case ST::CaptureSessionSample::Type::GyroscopeEvent:
+            ctx.samples.gyro.newSample(sample.gyroscopeEvent, ctx.gyroMonitor.rate());
+            return;
+        default:;
+    }
+    if (sample.depthFrame.isValid()) {
+        ctx.samples.depth.newSample(sample.depthFrame, ctx.depthMonitor.rate());
+    }
+    if (sample.visibleFrame.isValid()) {
+        ctx.samples.visible.newSample(sample.visibleFrame, ctx.visibleMonitor.rate());
+    }
+    if (sample.infraredFrame.isValid()) {
+        ctx.samples.infrared.newSample(sample.infraredFrame, ctx.infraredMonitor.rate());
+    }
+}
+
+// Corrected samples reach the GUI from the pipeline's correct stage
+static void publishSample(SessionContext& ctx, const ST::CaptureSessionSample& sample) {
+    SampleSet samples;
     {
         std::unique_lock<std::mutex> u(ctx.lock);
-        depthCorrectionEnabled = ctx.config.depthCorrection;
+        updateSampleSet(ctx, sample);
+        samples = ctx.samples;
     }
-    // Slow, do outside context lock
-    if (depthCorrectionEnabled && sample.depthFrame.isValid()) {
-        // Internals of const ST::DepthFrame are still mutable
-        ST::DepthFrame x = sample.depthFrame;
-        x.applyExpensiveCorrection();
+    if (ctx.gui) {
+        ctx.gui->updateSamples(samples);
     }
+}
 
-    ctx.occWriterLock.lock();
-    if (ctx.occWriter) {
-        ctx.occWriter->writeCaptureSample(sample);
-    }
-    ctx.occWriterLock.unlock();
+// SDK callback: cheap bookkeeping only, real work is queued to the stages
+static void handleSessionOutput(SessionContext& ctx, const ST::CaptureSessionSample& sample) {
+    Log::logv("New sample of type %d: %s", (int)sample.type, ST::CaptureSessionSample::toString(sample.type));
 
-    SampleSet samples;
     {
         std::unique_lock<std::mutex> u(ctx.lock);
+        // Rates are measured at arrival; samples reach the GUI from the correct stage
         switch (sample.type) {
-            case ST::CaptureSessionSample::Type::DepthFrame: {
-                ctx.depthMonitor.tick();
-                ctx.samples.depth.newSample(sample.depthFrame, ctx.depthMonitor.rate());
-            } break;
-            case ST::CaptureSessionSample::Type::VisibleFrame: {
-                ctx.visibleMonitor.tick();
-                ctx.samples.visible.newSample(sample.visibleFrame, ctx.visibleMonitor.rate());
-            } break;
-            case ST::CaptureSessionSample::Type::InfraredFrame: {
-                ctx.infraredMonitor.tick();
-                ctx.samples.infrared.newSample(sample.infraredFrame, ctx.infraredMonitor.rate());
-            } break;
-            case ST::CaptureSessionSample::Type::AccelerometerEvent: {
-                ctx.accelMonitor.tick();
-                ctx.samples.accel.newSample(sample.accelerometerEvent, ctx.accelMonitor.rate());
-            } break;
-            case ST::CaptureSessionSample::Type::GyroscopeEvent: {
-                ctx.gyroMonitor.tick();
-                ctx.samples.gyro.newSample(sample.gyroscopeEvent, ctx.gyroMonitor.rate());
-            } break;
+            case ST::CaptureSessionSample::Type::DepthFrame: ctx.depthMonitor.tick(); break;
+            case ST::CaptureSessionSample::Type::VisibleFrame: ctx.visibleMonitor.tick(); break;
+            case ST::CaptureSessionSample::Type::InfraredFrame: ctx.infraredMonitor.tick(); break;
+            case ST::CaptureSessionSample::Type::AccelerometerEvent: ctx.accelMonitor.tick(); break;
+            case ST::CaptureSessionSample::Type::GyroscopeEvent: ctx.gyroMonitor.tick(); break;
             case ST::CaptureSessionSample::Type::SynchronizedFrames: {
-                if (sample.depthFrame.isValid()) {
-                    ctx.depthMonitor.tick();
-                    ctx.samples.depth.newSample(sample.depthFrame, ctx.depthMonitor.rate());
-                }
-                if (sample.visibleFrame.isValid()) {
-                    ctx.visibleMonitor.tick();
-                    ctx.samples.visible.newSample(sample.visibleFrame, ctx.visibleMonitor.rate());
-                }
-                if (sample.infraredFrame.isValid()) {
-                    ctx.infraredMonitor.tick();
-                    ctx.samples.infrared.newSample(sample.infraredFrame, ctx.infraredMonitor.rate());
-                }
+                if (sample.depthFrame.isValid()) ctx.depthMonitor.tick();
+                if (sample.visibleFrame.isValid()) ctx.visibleMonitor.tick();
+                if (sample.infraredFrame.isValid()) ctx.infraredMonitor.tick();
             } break;
             default:
                 Log::logv("Not handling sample of type %d: %s", (int)sample.type, ST::CaptureSessionSample::toString(sample.type));
@@ -288,10 +365,10 @@ static void handleSessionOutput(SessionContext& ctx, const ST::CaptureSessionSam
             ctx.haveFirstSample = true;
             ctx.lastSampleTime = now;
         }
-        samples = ctx.samples;
     }
-    if (ctx.gui) {
-        ctx.gui->updateSamples(samples);
+
+    if (!ctx.pipeline->submit(sample)) {
+        Log::logv("Pipeline not running, discarding sample");
     }
 }
 
@@ -306,17 +383,23 @@ struct SessionDelegate : ST::CaptureSessionDelegate {
     }
 };
 
-static int sessionControlLoop(const AppConfig& initialConfig) {
+static int sessionControlLoop(const AppConfig& initialConfig, const KeyframeGateConfig& keyframeConfig, const PipelineConfig& pipelineConfig) {
     Log::log("Enter session control loop");
     bool exitApp = false;
     int exitStatus = 0;
 
     SessionContext ctx;
     ctx.config = initialConfig;
+    ctx.pipeline = std::make_unique<SamplePipeline>(pipelineConfig, keyframeConfig);
+    ctx.pipeline->setPublisher([&ctx](const ST::CaptureSessionSample& sample) {
+        publishSample(ctx, sample);
+    });
+    ctx.pipeline->setDepthCorrection(ctx.config.depthCorrection);
     if (!ctx.config.headless) {
         auto guiConfigCallback = [&ctx](const AppConfig& newConfig) {
             std::unique_lock<std::mutex> u(ctx.lock);
             ctx.config = newConfig;
+            ctx.pipeline->setDepthCorrection(newConfig.depthCorrection);
             ctx.cond.notify_all();
         };
         auto guiExitCallback = [&ctx, &exitApp]() {
@@ -358,10 +441,12 @@ static int sessionControlLoop(const AppConfig& initialConfig) {
             ctx.reset();
         }
 
+        ST::CaptureSessionSettings settings = sessionSettingsForConfig(runningConfig);
+        setNominalRates(*ctx.pipeline, runningConfig, settings);
         ST::CaptureSession session;
         SessionDelegate delegate(ctx);
         session.setDelegate(&delegate);
-        session.startMonitoring(sessionSettingsForConfig(runningConfig));
+        session.startMonitoring(settings);
 
         // OCC input does not generate CaptureSessionEventId::Ready
         if (runningConfig.streaming.source == StreamingSource::Sensor) {
@@ -401,7 +486,6 @@ static int sessionControlLoop(const AppConfig& initialConfig) {
             }
         }
 
-        ctx.occWriterLock.lock();
         if (!runningConfig.outputOccPath.empty()) {
             Log::log("Create OCC writer for path %s", runningConfig.outputOccPath.c_str());
             ctx.occWriter = std::make_unique<ST::OCCFileWriter>();
@@ -410,21 +494,32 @@ static int sessionControlLoop(const AppConfig& initialConfig) {
         else {
             ctx.occWriter = nullptr;
         }
-        ctx.occWriterLock.unlock();
+        ctx.pipeline->setWriter(ctx.occWriter.get());
+        const PipelineConfig& pc = ctx.pipeline->config();
+        Log::log("Start pipeline: queue depth %zu, correct %s, record %s",
+            pc.queueDepth, queuePolicyName(pc.correctPolicy), queuePolicyName(pc.recordPolicy));
+        ctx.pipeline->start();
         Log::log("Start streaming");
         session.startStreaming();
         // Samples now arriving...
 
         {
-            // Wait for end of capture
+            // Wait for end of capture, reporting pipeline losses as they happen
             std::unique_lock<std::mutex> u(ctx.lock);
+            unsigned long long reportedLoss = 0;
             while (
                 ctx.config.streaming.equiv(runningConfig.streaming) &&
                 !ctx.endOfStream &&
                 !ctx.streamError &&
                 !exitApp
             ) {
-                ctx.cond.wait(u);
+                if (ctx.cond.wait_for(u, std::chrono::seconds(5)) == std::cv_status::timeout) {
+                    unsigned long long loss = ctx.pipeline->loss();
+                    if (loss != reportedLoss) {
+                        logPipelineStats(*ctx.pipeline);
+                        reportedLoss = loss;
+                    }
+                }
             }
             if (!ctx.config.streaming.equiv(runningConfig.streaming)) {
                 Log::log("Config changed during streaming");
@@ -454,13 +549,19 @@ static int sessionControlLoop(const AppConfig& initialConfig) {
             }
         }
         session.stopStreaming();
-        ctx.occWriterLock.lock();
+        ctx.pipeline->stop();
+        logPipelineStats(*ctx.pipeline);
+        ctx.pipeline->setWriter(nullptr);
         if (ctx.occWriter) {
             Log::log("Finalize OCC writer");
             ctx.occWriter->finalizeWriting();
             ctx.occWriter = nullptr;
+            if (ctx.pipeline->keyframeConfig().enabled) {
+                KeyframeGateStats st = ctx.pipeline->keyframeStats();
+                Log::log("Keyframes: kept %llu, skipped %llu, ~%.1f MB uncompressed not written",
+                    st.framesKept, st.framesSkipped, st.bytesSaved / (1024.0 * 1024.0));
+            }
         }
-        ctx.occWriterLock.unlock();
     }
 
     if (ctx.gui) {
@@ -473,10 +574,12 @@ static int sessionControlLoop(const AppConfig& initialConfig) {
 
 int main(int argc, char **argv) {
     AppConfig config;
-    parseOptions(config, argc, argv);
+    KeyframeGateConfig keyframeConfig;
+    PipelineConfig pipelineConfig;
+    parseOptions(config, keyframeConfig, pipelineConfig, argc, argv);
     if (config.headless && !config.streaming.anyStreamsEnabled()) {
         fputs("Headless mode enabled but no streams enabled. This will not do anything useful.\n", stderr);
         return 1;
     }
-    return sessionControlLoop(config);
+    return sessionControlLoop(config, keyframeConfig, pipelineConfig);
 }
@@ -0,0 +1,420 @@
+#pragma once
+
+#include "KeyframeGate.h"
+#include "Pipeline.h"
+
+#include <math.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Queues between the SDK callback, the correction stage and the OCC record stage
+struct PipelineConfig {
+    size_t queueDepth = 8;
+    QueuePolicy correctPolicy = QueuePolicy::Block;
+    QueuePolicy recordPolicy = QueuePolicy::Block;
+};
+
+// Recorder's sample path: SDK callback -> correct queue -> correct stage
+// (depth correction) -> record queue -> record stage (keyframe gate, OCC).
+//
+// `Sample` has the shape of ST::CaptureSessionSample (type, depthFrame,
+// visibleFrame, infraredFrame, accelerometerEvent, gyroscopeEvent) and
+// `Writer` provides writeCaptureSample(const Sample&), so the benchmark can
+// drive the same stages with synthetic samples.
+template <typename Sample, typename Writer>
+class RecorderPipeline {
+public:
+    using Type = typename Sample::Type;
+
+    RecorderPipeline(const PipelineConfig& config, const KeyframeGateConfig& keyframes)
+        : _config(config) {
+        _keyframes.gate = KeyframeGate(keyframes);
+    }
+
+    ~RecorderPipeline() {
+        stop();
+    }
+
+    const PipelineConfig& config() const { return _config; }
+
+    // Called from the correct stage once a sample is corrected and queued for
+    // recording, e.g. to hand it to the GUI
+    void setPublisher(std::function<void(const Sample&)> publish) {
+        _publish = publish;
+    }
+
+    // Called on the record stage thread for each sample written, with the
+    // time since submit() in microseconds
+    void setWrittenCallback(std::function<void(unsigned streams, double usec)> written) {
+        _written = written;
+    }
+
+    void setDepthCorrection(bool enabled) {
+        _depthCorrection = enabled;
+    }
+
+    // See UpstreamDropCounter::setNominalRate; takes effect at start()
+    void setNominalRate(unsigned streamBit, double hz) {
+        std::unique_lock<std::mutex> u(_upstreamLock);
+        _upstreamDrops[StreamBit::index(streamBit)].setNominalRate(hz);
+    }
+
+    // Samples are discarded while no writer is set. A new writer starts a new
+    // keyframe sequence; keyframe stats stay readable after clearing it.
+    void setWriter(Writer *writer) {
+        std::unique_lock<std::mutex> u(_writerLock);
+        _writer = writer;
+        if (_writer) {
+            _keyframes.reset();
+        }
+    }
+
+    void start() {
+        {
+            std::unique_lock<std::mutex> u(_upstreamLock);
+            for (auto& d : _upstreamDrops) {
+                d.reset();
+            }
+        }
+        _correctQueue = std::make_unique<BoundedQueue<Queued>>("correct", _config.queueDepth, _config.correctPolicy);
+        _recordQueue = std::make_unique<BoundedQueue<Queued>>("record", _config.queueDepth, _config.recordPolicy);
+        _correctThread = std::thread(&RecorderPipeline::runCorrectStage, this);
+        _recordThread = std::thread(&RecorderPipeline::runRecordStage, this);
+    }
+
+    // Drains both stages; call once no more samples are submitted. Queue
+    // stats stay readable until the next start().
+    void stop() {
+        if (!_correctThread.joinable()) {
+            return;
+        }
+        _correctQueue->close();
+        _correctThread.join();
+        _recordThread.join();
+    }
+
+    // SDK callback side: counts upstream gaps and queues the sample.
+    // Returns false if the pipeline is not running.
+    bool submit(const Sample& sample) {
+        tickUpstreamDrops(sample);
+        unsigned streams = sampleStreams(sample);
+        return _correctQueue && _correctQueue->push(Queued{sample, std::chrono::steady_clock::now()},
+            streams, sampleDroppable(streams));
+    }
+
+    StageStats correctStats() const {
+        return _correctQueue ? _correctQueue->stats() : StageStats();
+    }
+
+    StageStats recordStats() const {
+        return _recordQueue ? _recordQueue->stats() : StageStats();
+    }
+
+    std::string describeUpstreamDrops() const {
+        unsigned long long counts[StreamBit::count];
+        std::unique_lock<std::mutex> u(_upstreamLock);
+        for (int i = 0; i < StreamBit::count; ++i) {
+            counts[i] = _upstreamDrops[i].dropped();
+        }
+        return describeStreamCounts(counts);
+    }
+
+    // Total of all loss counters, to tell whether anything changed since the last report
+    unsigned long long loss() const {
+        unsigned long long n = 0;
+        {
+            std::unique_lock<std::mutex> u(_upstreamLock);
+            for (auto& d : _upstreamDrops) {
+                n += d.dropped();
+            }
+        }
+        for (const StageStats& st : {correctStats(), recordStats()}) {
+            n += st.totalDropped() + st.totalDegraded();
+        }
+        return n;
+    }
+
+    const KeyframeGateConfig& keyframeConfig() const {
+        return _keyframes.gate.config();
+    }
+
+    KeyframeGateStats keyframeStats() const {
+        std::unique_lock<std::mutex> u(_writerLock);
+        return _keyframes.gate.stats();
+    }
+
+private:
+    // A sample and when it was submitted, for end-to-end latency
+    struct Queued {
+        Sample sample;
+        std::chrono::steady_clock::time_point submitted;
+    };
+
+    // Keyframe gate plus the per-capture-instant bookkeeping that keeps
+    // frames from one instant together when they arrive as separate samples
+    struct KeyframeSelector {
+        static const size_t maxHeld = 64;
+
+        KeyframeGate gate;
+        bool sawImage = false;
+        bool haveDecision = false;
+        double decisionInstant = 0.0;
+        bool decisionKeep = true;
+        // held[0] is a depth-only frame; IMU samples that arrived after it follow
+        std::vector<Queued> held;
+
+        void reset() {
+            gate.reset();
+            sawImage = false;
+            haveDecision = false;
+            held.clear();
+        }
+    };
+
+    // Uncompressed payload size, used to estimate what the keyframe gate saves
+    static size_t frameBytes(const Sample& sample) {
+        size_t bytes = 0;
+        if (sample.depthFrame.isValid()) {
+            bytes += (size_t)sample.depthFrame.width() * sample.depthFrame.height() * 2;
+        }
+        if (sample.visibleFrame.isValid()) {
+            bytes += (size_t)sample.visibleFrame.width() * sample.visibleFrame.height() * 3 / 2;
+        }
+        if (sample.infraredFrame.isValid()) {
+            bytes += (size_t)sample.infraredFrame.width() * sample.infraredFrame.height() * 2;
+        }
+        return bytes;
+    }
+
+    // Timestamp of the capture instant a frame sample belongs to
+    static double captureInstant(const Sample& sample) {
+        if (sample.visibleFrame.isValid()) return sample.visibleFrame.timestamp();
+        if (sample.infraredFrame.isValid()) return sample.infraredFrame.timestamp();
+        return sample.depthFrame.timestamp();
+    }
+
+    static bool sameCaptureInstant(double a, double b) {
+        return fabs(a - b) < 0.010; // Well under one frame period at 30 Hz
+    }
+
+    static bool isFrameSample(const Sample& sample) {
+        switch (sample.type) {
+            case Type::DepthFrame:
+            case Type::VisibleFrame:
+            case Type::InfraredFrame:
+            case Type::SynchronizedFrames:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static unsigned sampleStreams(const Sample& sample) {
+        switch (sample.type) {
+            case Type::AccelerometerEvent: return StreamBit::Accel;
+            case Type::GyroscopeEvent: return StreamBit::Gyro;
+            default:;
+        }
+        unsigned streams = 0;
+        if (sample.depthFrame.isValid()) streams |= StreamBit::Depth;
+        if (sample.visibleFrame.isValid()) streams |= StreamBit::Visible;
+        if (sample.infraredFrame.isValid()) streams |= StreamBit::Infrared;
+        return streams;
+    }
+
+    // IMU is small and needed at full rate, so only frames may be dropped
+    static bool sampleDroppable(unsigned streams) {
+        return !(streams & (StreamBit::Accel | StreamBit::Gyro));
+    }
+
+    void tickUpstreamDrops(const Sample& sample) {
+        std::unique_lock<std::mutex> u(_upstreamLock);
+        switch (sample.type) {
+            case Type::AccelerometerEvent:
+                _upstreamDrops[StreamBit::index(StreamBit::Accel)].tick(sample.accelerometerEvent.timestamp());
+                return;
+            case Type::GyroscopeEvent:
+                _upstreamDrops[StreamBit::index(StreamBit::Gyro)].tick(sample.gyroscopeEvent.timestamp());
+                return;
+            default:;
+        }
+        if (sample.depthFrame.isValid()) _upstreamDrops[StreamBit::index(StreamBit::Depth)].tick(sample.depthFrame.timestamp());
+        if (sample.visibleFrame.isValid()) _upstreamDrops[StreamBit::index(StreamBit::Visible)].tick(sample.visibleFrame.timestamp());
+        if (sample.infraredFrame.isValid()) _upstreamDrops[StreamBit::index(StreamBit::Infrared)].tick(sample.infraredFrame.timestamp());
+    }
+
+    // Decides for a frame sample, reusing the decision already made for its
+    // capture instant so depth, visible and infrared stay paired in the OCC
+    bool decideFrame(const Sample& sample) {
+        KeyframeSelector& sel = _keyframes;
+        double t = captureInstant(sample);
+        if (sel.haveDecision && sameCaptureInstant(t, sel.decisionInstant)) {
+            sel.gate.countFollower(sel.decisionKeep, frameBytes(sample));
+            return sel.decisionKeep;
+        }
+
+        // Difference score prefers visible luma, falls back to infrared (10-bit), else IMU/time only
+        bool keep;
+        if (sample.visibleFrame.isValid()) {
+            keep = sel.gate.shouldKeep(t, sample.visibleFrame.yData(),
+                sample.visibleFrame.width(), sample.visibleFrame.height(), 1.0f, frameBytes(sample));
+        }
+        else if (sample.infraredFrame.isValid()) {
+            keep = sel.gate.shouldKeep(t, sample.infraredFrame.data(),
+                sample.infraredFrame.width(), sample.infraredFrame.height(), 0.25f, frameBytes(sample));
+        }
+        else {
+            keep = sel.gate.shouldKeep(t, frameBytes(sample));
+        }
+        sel.haveDecision = true;
+        sel.decisionInstant = t;
+        sel.decisionKeep = keep;
+        return keep;
+    }
+
+    // Call with _writerLock held and _writer set
+    void write(const Queued& q) {
+        _writer->writeCaptureSample(q.sample);
+        if (_written) {
+            _written(sampleStreams(q.sample), std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - q.submitted).count());
+        }
+    }
+
+    // Writes out samples held behind a depth-only frame. Call with _writerLock held.
+    void flushHeldSamples() {
+        KeyframeSelector& sel = _keyframes;
+        for (auto& held : sel.held) {
+            if (!isFrameSample(held.sample) || decideFrame(held.sample)) {
+                write(held);
+            }
+        }
+        sel.held.clear();
+    }
+
+    // Writes the sample unless the keyframe gate skips it. IMU events are
+    // always written. Call with _writerLock held and _writer set.
+    void recordSample(const Queued& q) {
+        KeyframeSelector& sel = _keyframes;
+        const Sample& sample = q.sample;
+        if (!sel.gate.config().enabled) {
+            write(q);
+            return;
+        }
+
+        if (!isFrameSample(sample)) {
+            if (sample.type == Type::AccelerometerEvent) {
+                const auto& a = sample.accelerometerEvent.acceleration();
+                sel.gate.accelSample(a.x, a.y, a.z);
+            }
+            else if (sample.type == Type::GyroscopeEvent) {
+                const auto& r = sample.gyroscopeEvent.rotationRate();
+                sel.gate.gyroSample(r.x, r.y, r.z);
+            }
+            // Keep OCC in arrival order while a depth frame waits for its image
+            if (sel.held.empty()) {
+                write(q);
+            }
+            else {
+                sel.held.push_back(q);
+                if (sel.held.size() >= KeyframeSelector::maxHeld) {
+                    flushHeldSamples();
+                }
+            }
+            return;
+        }
+
+        bool hasImage = sample.visibleFrame.isValid() || sample.infraredFrame.isValid();
+        if (hasImage) {
+            sel.sawImage = true;
+            if (!sel.held.empty() && !sameCaptureInstant(captureInstant(sel.held.front().sample), captureInstant(sample))) {
+                flushHeldSamples();
+            }
+            bool keep = decideFrame(sample);
+            // A held depth frame from this instant now follows the image decision
+            flushHeldSamples();
+            if (keep) {
+                write(q);
+            }
+            return;
+        }
+
+        // Depth only (no frame sync): wait for the image frame of the same instant
+        flushHeldSamples();
+        bool decided = sel.haveDecision && sameCaptureInstant(captureInstant(sample), sel.decisionInstant);
+        if (sel.sawImage && !decided) {
+            sel.held.push_back(q);
+        }
+        else if (decideFrame(sample)) {
+            write(q);
+        }
+    }
+
+    // Correct stage: depth correction (skipped when degraded), then publish
+    void runCorrectStage() {
+        Queued q;
+        bool degrade = false;
+        while (_correctQueue->pop(q, degrade)) {
+            const Sample& sample = q.sample;
+            if (_depthCorrection && sample.depthFrame.isValid()) {
+                if (degrade) {
+                    _correctQueue->countDegraded(StreamBit::Depth);
+                }
+                else {
+                    // Internals of const ST::DepthFrame are still mutable
+                    auto x = sample.depthFrame;
+                    x.applyExpensiveCorrection();
+                }
+            }
+
+            unsigned streams = sampleStreams(sample);
+            _recordQueue->push(q, streams, sampleDroppable(streams));
+
+            // Only publish frames once correction is done with them
+            if (_publish) {
+                _publish(sample);
+            }
+        }
+        _recordQueue->close();
+    }
+
+    // Record stage: keyframe gate and OCC writing
+    void runRecordStage() {
+        Queued q;
+        bool degrade = false; // Nothing optional to skip here
+        while (_recordQueue->pop(q, degrade)) {
+            std::unique_lock<std::mutex> u(_writerLock);
+            if (_writer) {
+                recordSample(q);
+            }
+        }
+        std::unique_lock<std::mutex> u(_writerLock);
+        if (_writer) {
+            flushHeldSamples();
+        }
+    }
+
+    PipelineConfig _config;
+    std::function<void(const Sample&)> _publish;
+    std::function<void(unsigned, double)> _written;
+    std::atomic<bool> _depthCorrection{false};
+
+    mutable std::mutex _upstreamLock;
+    UpstreamDropCounter _upstreamDrops[StreamBit::count];
+
+    mutable std::mutex _writerLock;
+    Writer *_writer = nullptr;
+    KeyframeSelector _keyframes; // Guarded by _writerLock
+
+    std::unique_ptr<BoundedQueue<Queued>> _correctQueue;
+    std::unique_ptr<BoundedQueue<Queued>> _recordQueue;
+    std::thread _correctThread;
+    std::thread _recordThread;
+};
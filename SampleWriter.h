@@ -0,0 +1,71 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include "sys/stat.h"
+
+// Persists samples in the SimpleStreamer dataset layout:
+//   <dir>/gray/<t>.png, <dir>/depth/<t>.png and timestamp.txt,
+//   acc_timestamp.txt, gyo_timestamp.txt with one line per sample.
+// Takes raw buffers so it can be driven by the SDK delegate or by synthetic
+// samples (see Benchmark.cpp).
+class SampleWriter {
+public:
+    bool open(const std::string& dir) {
+        _dir = dir;
+        std::string gray = _dir + "/gray";
+        std::string depth = _dir + "/depth";
+        mkdir(_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+        mkdir(gray.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+        mkdir(depth.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+        _imgTs.open((_dir + "/timestamp.txt").c_str());
+        _accTs.open((_dir + "/acc_timestamp.txt").c_str());
+        _gyoTs.open((_dir + "/gyo_timestamp.txt").c_str());
+        return _imgTs.is_open() && _accTs.is_open() && _gyoTs.is_open();
+    }
+
+    // Both images are named after the visible timestamp so they associate 1:1
+    void writeFrames(double visibleTimestamp,
+                     const unsigned char *gray, int grayWidth, int grayHeight,
+                     const float *depthMm, int depthWidth, int depthHeight) {
+        std::stringstream ss_tg;
+        ss_tg << std::fixed << std::setprecision(9) << visibleTimestamp;
+        std::string tg = ss_tg.str();
+
+        cv::Mat I_g(grayHeight, grayWidth, CV_8UC1, (void*)gray);
+        cv::imwrite(_dir + "/gray/" + tg + ".png", I_g);
+
+        cv::Mat I_d(depthHeight, depthWidth, CV_32FC1, (void*)depthMm);
+        I_d.convertTo(_depth16, CV_16UC1);
+        cv::imwrite(_dir + "/depth/" + tg + ".png", _depth16);
+
+        _imgTs << tg << "  " << "gray/" << tg << ".png  " << tg << "  " << "depth/" << tg << ".png  " << "\n";
+    }
+
+    void writeAccel(double timestamp, float x, float y, float z) {
+        writeImu(_accTs, timestamp, x, y, z);
+    }
+
+    void writeGyro(double timestamp, float x, float y, float z) {
+        writeImu(_gyoTs, timestamp, x, y, z);
+    }
+
+private:
+    static void writeImu(std::ofstream& out, double timestamp, float x, float y, float z) {
+        out << std::fixed << std::setprecision(9) << timestamp
+            << " " << std::setprecision(6) << x
+            << " " << std::setprecision(6) << y
+            << " " << std::setprecision(6) << z << "\n";
+    }
+
+    std::string _dir;
+    std::ofstream _imgTs;
+    std::ofstream _accTs;
+    std::ofstream _gyoTs;
+    cv::Mat _depth16;
+};
@@ -1,6 +1,10 @@
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <stdio.h>
+#include <thread>
 
 #include <ST/CaptureSession.h>
 
@@ -14,13 +18,22 @@
 #include <sstream>
 #include <iomanip>
 #include "sys/stat.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "FramePipeline.h"
 
 using namespace std;
 using namespace cv;
 
-ofstream img_tsfile;
-ofstream acc_tsfile;
-ofstream gyo_tsfile;
+SampleWriter sampleWriter;
+
+KeyframeGate keyframeGate;
+
+// Frames are handed from the SDK thread to a writer thread so PNG encoding
+// does not stall capture
+unique_ptr<FramePipeline<SampleFrames<ST::CaptureSessionSample>>> framePipeline;
+unique_ptr<StreamerOutput<ST::CaptureSessionSample>> streamerOutput;
 
 struct SessionDelegate : ST::CaptureSessionDelegate {
     std::mutex lock;
@@ -49,94 +62,7 @@ struct SessionDelegate : ST::CaptureSessionDelegate {
     }
 
     void captureSessionDidOutputSample(ST::CaptureSession *, const ST::CaptureSessionSample& sample) {
-
-        Mat I_g;//(sample.depthFrame.height(), sample.depthFrame.width(), CV_32FC1, sample.depthFrame.depthInMillimeters());
-        std::stringstream ss_d;
-        std::stringstream ss_g;
-
-        stringstream ss_td;
-        stringstream ss_tg;
-        string td;
-        string tg;
-
-        string s;
-        string time_info;
-        stringstream ss_t;
-        unsigned char* pv;
-        float* pd;
-
-        // printf("Received capture session sample of type %d (%s)\n", (int)sample.type, ST::CaptureSessionSample::toString(sample.type));
-        switch (sample.type) {
-            case ST::CaptureSessionSample::Type::DepthFrame:
-                printf("Depth frame: size %dx%d\n", sample.depthFrame.width(), sample.depthFrame.height());
-                break;
-            case ST::CaptureSessionSample::Type::VisibleFrame:
-                printf("Visible frame: size %dx%d\n", sample.visibleFrame.width(), sample.visibleFrame.height());
-                break;
-            case ST::CaptureSessionSample::Type::InfraredFrame:
-                printf("Infrared frame: size %dx%d\n", sample.infraredFrame.width(), sample.infraredFrame.height());
-                break;
-            case ST::CaptureSessionSample::Type::SynchronizedFrames:
-                printf("Synchronized frames: depth %dx%d visible %dx%d infrared %dx%d\n", sample.depthFrame.width(), sample.depthFrame.height(), sample.visibleFrame.width(), sample.visibleFrame.height(), sample.infraredFrame.width(), sample.infraredFrame.height());
-                // printf("Depth frame: timestamp %.9f\n",sample.depthFrame.timestamp() );
-                // printf("Visible frame: timestamp %.9f\n",sample.visibleFrame.timestamp() );
-                // cout << sample.visibleFrame.glProjectionMatrix()<<endl;
-
-                cout << ( sample.visibleFrame.intrinsics() ).cx <<" "<< ( sample.visibleFrame.intrinsics() ).cy <<" "<< ( sample.visibleFrame.intrinsics() ).fx <<" "<< ( sample.visibleFrame.intrinsics() ).fy <<" "<<endl;
-
-                // cout << sample.depthFrame.glProjectionMatrix()<<endl;
-                cout << sample.depthFrame.colorCameraPoseInDepthCoordinateFrame()<<endl;
-                
-
-                pv = const_cast<unsigned char*>((sample.visibleFrame.undistorted()).yData());
-                I_g = cv::Mat(sample.visibleFrame.height(), sample.visibleFrame.width(), CV_8UC1, (void*)pv);
-
-                imshow("window",I_g);
-                waitKey(1);
-
-                ss_tg << fixed << setprecision(9)<<sample.visibleFrame.timestamp();
-                tg = ss_tg.str();
-                ss_d<<"/home/jin/Desktop/data/gray/"<< tg  << ".png";
-                s = ss_d.str();
-                imwrite( s, I_g );
-                ss_d.clear();
-
-                pd = const_cast<float*>( sample.depthFrame.depthInMillimeters() );
-                I_g = cv::Mat(sample.depthFrame.height(), sample.depthFrame.width(), CV_32FC1, (void*)pd );
-                I_g.convertTo(I_g, CV_16UC1);
-                ss_td<< fixed << setprecision(9)<<sample.depthFrame.timestamp();
-                td = ss_td.str();
-                ss_g<<"/home/jin/Desktop/data/depth/" << tg  << ".png";
-                s = "";
-                s = ss_g.str();
-                imwrite( s, I_g );
-                ss_g.clear();
-
-                ss_t << tg << "  "<< "gray/" << tg << ".png  "<< tg << "  "<< "depth/"<< tg << ".png  ";
-                time_info = ss_t.str();
-                img_tsfile << time_info <<"\n";
-
-
-                break;
-            case ST::CaptureSessionSample::Type::AccelerometerEvent:
-                // printf("Accelerometer event: [% .9f %.5f % .5f % .5f]\n", sample.accelerometerEvent.timestamp(), sample.accelerometerEvent.acceleration().x, sample.accelerometerEvent.acceleration().y, sample.accelerometerEvent.acceleration().z);
-                
-                ss_t << fixed << setprecision(9)<<sample.accelerometerEvent.timestamp()<< " " << setprecision(6)<<sample.accelerometerEvent.acceleration().x<< " " << setprecision(6)<<sample.accelerometerEvent.acceleration().y<< " " << setprecision(6)<<sample.accelerometerEvent.acceleration().z;
-                time_info = ss_t.str();
-                acc_tsfile << time_info <<"\n";
-
-                break;
-            case ST::CaptureSessionSample::Type::GyroscopeEvent:
-                // printf("Gyroscope event: [% .9f % .5f % .5f % .5f]\n", sample.gyroscopeEvent.timestamp(), sample.gyroscopeEvent.rotationRate().x, sample.gyroscopeEvent.rotationRate().y, sample.gyroscopeEvent.rotationRate().z);
-                
-                ss_t << fixed << setprecision(9)<<sample.gyroscopeEvent.timestamp() << " " << setprecision(6)<<sample.gyroscopeEvent.rotationRate().x<< " " << setprecision(6)<<sample.gyroscopeEvent.rotationRate().y<< " " << setprecision(6)<<sample.gyroscopeEvent.rotationRate().z;
-                time_info = ss_t.str();
-                gyo_tsfile << time_info <<"\n";
-
-                break;
-            default:
-                printf("Sample type %d unhandled\n", (int)sample.type);
-        }
+        streamerOutput->handleSample(sample);
     }
 
     void waitUntilReady() {
@@ -154,25 +80,86 @@ struct SessionDelegate : ST::CaptureSessionDelegate {
     }
 };
 
-int main(void) {
-	string d_dir = "/home/jin/Desktop/data/"; 
-	string d_gry = d_dir + "/gray"; 
-	string d_dpt = d_dir + "/depth"; 
-
-	mkdir(d_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-	mkdir(d_gry.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-  	mkdir(d_dpt.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-
-	string f_name = d_dir + "/timestamp.txt"; 
-	img_tsfile.open(f_name.c_str());
+static const char usageMsg[] =
+    "usage: SimpleStreamer [-h] [keyframe and pipeline options...]\n"
+    "-k/--keyframes: Only write frames when the rig moves or the scene changes (IMU is always logged)\n"
+    "--kf-gyro <rad/s>: Gyroscope rate threshold (default 0.05)\n"
+    "--kf-accel <g>: Accelerometer deviation threshold (default 0.05)\n"
+    "--kf-diff <0-255>: Mean frame difference threshold (default 6)\n"
+    "--kf-interval <seconds>: Maximum time between keyframes (default 1)\n"
+    "-Q/--queue-depth <n>: Frames buffered between capture and the writer (default 16)\n"
+    "--write-policy <block|drop-oldest|degrade>: When writing falls behind (default block; degrade skips display, drop-oldest drops display-only frames)\n"
+    "";
+
+static void parseOptions(KeyframeGateConfig& kf, size_t& queueDepth, QueuePolicy& writePolicy, int argc, char **argv) {
+#define NEXT do { \
+    if (++i >= argc) { \
+        fprintf(stderr, "Expected argument after: %s\n", argv[i - 1]); \
+        fputs(usageMsg, stderr); \
+        exit(1); \
+    } \
+} while (0)
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            fputs(usageMsg, stdout);
+            exit(0);
+        }
+        else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keyframes")) {
+            kf.enabled = true;
+        }
+        else if (!strcmp(argv[i], "--kf-gyro")) {
+            NEXT;
+            kf.gyroThreshold = std::stof(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--kf-accel")) {
+            NEXT;
+            kf.accelThreshold = std::stof(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--kf-diff")) {
+            NEXT;
+            kf.diffThreshold = std::stof(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--kf-interval")) {
+            NEXT;
+            kf.maxInterval = std::stod(argv[i]);
+        }
+        else if (!strcmp(argv[i], "-Q") || !strcmp(argv[i], "--queue-depth")) {
+            NEXT;
+            queueDepth = (size_t)std::max(1, std::stoi(argv[i]));
+        }
+        else if (!strcmp(argv[i], "--write-policy")) {
+            NEXT;
+            if (!parseQueuePolicy(argv[i], writePolicy)) {
+                fprintf(stderr, "Unknown queue policy: %s\n", argv[i]);
+                fputs(usageMsg, stderr);
+                exit(1);
+            }
+        }
+        else {
+            fprintf(stderr, "Argument not understood: %s\n", argv[i]);
+            fputs(usageMsg, stderr);
+            exit(1);
+        }
+    }
+#undef NEXT
+    if (!queuePolicyFits(writePolicy, queueDepth)) {
+        fputs("--write-policy degrade needs a queue depth of at least 2\n", stderr);
+        exit(1);
+    }
+}
 
-    f_name = "";
-    f_name = d_dir + "/acc_timestamp.txt"; 
-    acc_tsfile.open(f_name.c_str());
+int main(int argc, char **argv) {
+    KeyframeGateConfig kfConfig;
+    size_t queueDepth = 16;
+    QueuePolicy writePolicy = QueuePolicy::Block;
+    parseOptions(kfConfig, queueDepth, writePolicy, argc, argv);
+    keyframeGate = KeyframeGate(kfConfig);
 
-    f_name = "";
-    f_name = d_dir + "/gyo_timestamp.txt"; 
-    gyo_tsfile.open(f_name.c_str());
+    string d_dir = "/home/jin/Desktop/data/";
+    if (!sampleWriter.open(d_dir)) {
+        printf("Failed to open output files in %s\n", d_dir.c_str());
+        return 1;
+    }
 
     printf("Initialize capture session!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
 
@@ -211,8 +198,22 @@ int main(void) {
 
     printf("Waiting for session to become ready...\n");
     delegate.waitUntilReady();
+    framePipeline.reset(new FramePipeline<SampleFrames<ST::CaptureSessionSample>>(sampleWriter, keyframeGate, queueDepth, writePolicy, true));
+    streamerOutput.reset(new StreamerOutput<ST::CaptureSessionSample>(*framePipeline));
+    streamerOutput->setNominalRates(settings.structureCore.depthFramerate, settings.structureCore.visibleFramerate);
+    thread writer([]() { framePipeline->runWriter(); });
     session.startStreaming();
     delegate.waitUntilDone();
     session.stopStreaming();
+
+    framePipeline->close();
+    writer.join();
+    streamerOutput->printStats();
+
+    if (kfConfig.enabled) {
+        const KeyframeGateStats& st = keyframeGate.stats();
+        printf("Keyframes: kept %llu, skipped %llu, ~%.1f MB raw not written\n",
+            st.framesKept, st.framesSkipped, st.bytesSaved / (1024.0 * 1024.0));
+    }
     return 0;
 }